@@ -0,0 +1,64 @@
+#include "catch.hpp"
+
+#include "AppHdr.h"
+
+#include "files.h"
+#include "ghost.h"
+#include "package.h"
+#include "syscalls.h"
+#include "tags.h"
+
+TEST_CASE( "Ghosts round-trip through a bones package", "[single-file]" ) {
+
+    const char *filename = "catch2-tests-" BONES_STORE_FILE;
+
+    ghost_demon ghost;
+    ghost.name = "Bones";
+    ghost.species = SP_HUMAN;
+    ghost.job = JOB_FIGHTER;
+    ghost.xl = 7;
+
+    // A place's chunk as the game writes it: a bones header, then entries
+    // of the ghosts from one death each.
+    vector<unsigned char> entry;
+    {
+        writer outw(&entry);
+        tag_write_ghosts(outw, { ghost, ghost });
+    }
+    {
+        package store(filename, true, true);
+        writer outw(&store, "D_3");
+        write_ghost_version(outw);
+        marshallShort(outw, 2);
+        for (int i = 0; i < 2; i++)
+        {
+            marshallInt(outw, entry.size());
+            outw.write(&entry[0], entry.size());
+        }
+    }
+
+    SECTION ("the header reads back from the chunk") {
+        package store(filename, false);
+        reader inf(&store, "D_3");
+        inf.set_safe_read(true);
+        const save_version version = read_ghost_header(inf);
+        REQUIRE(version == save_version::current_bones());
+        REQUIRE(unmarshallShort(inf) == 2);
+        REQUIRE(unmarshallInt(inf) == (int)entry.size());
+    }
+
+    SECTION ("every ghost is listed") {
+        const auto places = load_bones_store(filename);
+        REQUIRE(places.size() == 1);
+        REQUIRE(places.count("D_3"));
+        const vector<ghost_demon> &ghosts = places.at("D_3");
+        REQUIRE(ghosts.size() == 4);
+        for (const ghost_demon &g : ghosts)
+        {
+            REQUIRE(g.name == ghost.name);
+            REQUIRE(g.xl == ghost.xl);
+        }
+    }
+
+    unlink_u(filename);
+}
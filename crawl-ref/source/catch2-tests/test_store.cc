@@ -0,0 +1,52 @@
+#include "catch.hpp"
+
+#include "AppHdr.h"
+
+#include "store.h"
+#include "tags.h"
+
+TEST_CASE( "Hash table keys are interned", "[single-file]" ) {
+
+    const string name = "test_store_key";
+    const CrawlHashKey a(name);
+    const CrawlHashKey b("test_store_key");
+    const CrawlHashKey c("test_store_other_key");
+
+    REQUIRE(a == b);
+    REQUIRE(a != c);
+    REQUIRE(&a.str() == &b.str());
+    REQUIRE(a.str() == name);
+}
+
+TEST_CASE( "Hash tables marshall by key name", "[single-file]" ) {
+
+    CrawlHashTable forward, backward;
+    forward["test_store_b"] = 2;
+    forward["test_store_a"] = 1;
+    forward["test_store_c"] = "three";
+    backward["test_store_c"] = "three";
+    backward["test_store_a"] = 1;
+    backward["test_store_b"] = 2;
+
+    vector<unsigned char> forward_data, backward_data;
+    writer forward_writer(&forward_data);
+    forward.write(forward_writer);
+    writer backward_writer(&backward_data);
+    backward.write(backward_writer);
+
+    SECTION ("whatever order the keys were added in") {
+        REQUIRE(forward_data == backward_data);
+    }
+
+    SECTION ("and read back the same") {
+        CrawlHashTable table;
+        reader th(forward_data, TAG_MINOR_VERSION);
+        table.read(th);
+
+        const CrawlHashTable &copy = table;
+        REQUIRE(copy.size() == 3);
+        REQUIRE(copy["test_store_a"].get_int() == 1);
+        REQUIRE(copy["test_store_b"].get_int() == 2);
+        REQUIRE(copy["test_store_c"].get_string() == "three");
+    }
+}
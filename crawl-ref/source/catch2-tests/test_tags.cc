@@ -2,6 +2,7 @@
 
 #include "AppHdr.h"
 
+#include "package.h"
 #include "tags.h"
 
 void unmarshall_vehumet_spells(reader &th, set<spell_type>& old_gifts,
@@ -193,3 +194,142 @@ TEST_CASE( "Monster spell unmarshalling can remove removed spells", "[single-fil
         REQUIRE(r.valid() == false);
     }
 }
+
+TEST_CASE( "Bulk marshalling matches value-by-value marshalling", "[single-file]" ) {
+
+    SECTION ("shorts and ints are written in network order") {
+        const int16_t shorts[] = { 0, 1, -1, 0x1234, -0x8000 };
+        const int32_t ints[] = { 0, -2, 0x12345678, INT32_MIN };
+
+        vector<unsigned char> single, bulk;
+        writer ws(&single), wb(&bulk);
+        for (int16_t s : shorts)
+            marshallShort(ws, s);
+        for (int32_t i : ints)
+            marshallInt(ws, i);
+        marshallShorts(wb, shorts, ARRAYSZ(shorts));
+        marshallInts(wb, ints, ARRAYSZ(ints));
+
+        REQUIRE(bulk == single);
+        REQUIRE(single[6] == 0x12);
+        REQUIRE(single[7] == 0x34);
+
+        auto r = reader(bulk);
+        int16_t shorts_in[ARRAYSZ(shorts)];
+        int32_t ints_in[ARRAYSZ(ints)];
+        unmarshallShorts(r, shorts_in, ARRAYSZ(shorts));
+        unmarshallInts(r, ints_in, ARRAYSZ(ints));
+
+        for (size_t i = 0; i < ARRAYSZ(shorts); i++)
+            REQUIRE(shorts_in[i] == shorts[i]);
+        for (size_t i = 0; i < ARRAYSZ(ints); i++)
+            REQUIRE(ints_in[i] == ints[i]);
+        REQUIRE(r.valid() == false);
+    }
+}
+
+TEST_CASE( "Package chunks can be read and skipped through", "[single-file]" ) {
+
+    const char *filename = "catch2-tests-chunk-read.tmp";
+    package save(filename, true, true);
+
+    // Enough data to span a few of the reader's blocks.
+    const size_t len = 3 * TAG_IO_BLOCK_SIZE + 100;
+    vector<unsigned char> data(len);
+    for (size_t i = 0; i < len; i++)
+        data[i] = (i * 7 + i / 251) & 0xff;
+
+    {
+        writer outf(&save, "test");
+        outf.write(&data[0], len);
+    }
+
+    {
+        reader inf(&save, "test");
+        inf.set_safe_read(true);
+        size_t pos = 0;
+
+        SECTION ("small skips and reads") {
+            for (; pos < 10; pos++)
+                REQUIRE(inf.readByte() == data[pos]);
+            inf.read(nullptr, 3 * 4);
+            pos += 3 * 4;
+            REQUIRE(inf.readByte() == data[pos++]);
+        }
+
+        SECTION ("skips across a block boundary") {
+            inf.read(nullptr, TAG_IO_BLOCK_SIZE - 5);
+            pos += TAG_IO_BLOCK_SIZE - 5;
+            REQUIRE(inf.readByte() == data[pos++]);
+            // From within a block, past the end of the next one.
+            inf.read(nullptr, TAG_IO_BLOCK_SIZE + 10);
+            pos += TAG_IO_BLOCK_SIZE + 10;
+            REQUIRE(inf.readByte() == data[pos++]);
+        }
+
+        SECTION ("reads across a block boundary") {
+            vector<unsigned char> buf(TAG_IO_BLOCK_SIZE + 10);
+            inf.read(&buf[0], 20);
+            REQUIRE(equal(buf.begin(), buf.begin() + 20, data.begin()));
+            pos += 20;
+            inf.read(&buf[0], buf.size());
+            REQUIRE(equal(buf.begin(), buf.end(), data.begin() + pos));
+            pos += buf.size();
+            // Up to a block boundary, then a big skip from there.
+            inf.read(nullptr, 2 * TAG_IO_BLOCK_SIZE - pos);
+            pos = 2 * TAG_IO_BLOCK_SIZE;
+            inf.read(nullptr, TAG_IO_BLOCK_SIZE + 1);
+            pos += TAG_IO_BLOCK_SIZE + 1;
+            REQUIRE(inf.readByte() == data[pos++]);
+        }
+
+        // Whatever happened above, the rest should still be there, and no
+        // more.
+        vector<unsigned char> rest(len - pos);
+        inf.read(&rest[0], rest.size());
+        REQUIRE(equal(rest.begin(), rest.end(), data.begin() + pos));
+        REQUIRE_THROWS_AS(inf.read(nullptr, 1), short_read_exception);
+    }
+
+    save.unlink();
+}
+
+TEST_CASE( "Chunks committed in the background can be read back", "[single-file]" ) {
+
+    const char *filename = "catch2-tests-commit-async.tmp";
+    package save(filename, true, true);
+
+    chunk_list chunks;
+    chunks.emplace_back("small", vector<unsigned char>(10, 'a'));
+    chunks.emplace_back("empty", vector<unsigned char>());
+    vector<unsigned char> big(3 * ZB_SIZE + 7);
+    for (size_t i = 0; i < big.size(); i++)
+        big[i] = (i * 13 + i / 509) & 0xff;
+    chunks.emplace_back("big", big);
+
+    bool committed = false;
+    save.commit_async(chunks, [&committed]() { committed = true; });
+    save.await_commit();
+    REQUIRE(committed);
+
+    {
+        reader inf(&save, "small");
+        inf.set_safe_read(true);
+        vector<unsigned char> small(10);
+        inf.read(&small[0], small.size());
+        REQUIRE(small == vector<unsigned char>(10, 'a'));
+        REQUIRE_THROWS_AS(inf.readByte(), short_read_exception);
+    }
+
+    REQUIRE(save.has_chunk("empty"));
+
+    {
+        reader inf(&save, "big");
+        inf.set_safe_read(true);
+        vector<unsigned char> back(big.size());
+        inf.read(&back[0], back.size());
+        REQUIRE(back == big);
+    }
+
+    save.unlink();
+}
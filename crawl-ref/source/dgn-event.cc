@@ -23,6 +23,16 @@ void dgn_event_dispatcher::clear()
             grid_triggers[x][y].reset(nullptr);
 }
 
+// Exchange all listeners with another dispatcher.
+void dgn_event_dispatcher::swap(dgn_event_dispatcher &other)
+{
+    std::swap(global_event_mask, other.global_event_mask);
+    listeners.swap(other.listeners);
+    for (int y = 0; y < GYM; ++y)
+        for (int x = 0; x < GXM; ++x)
+            grid_triggers[x][y].swap(other.grid_triggers[x][y]);
+}
+
 void dgn_event_dispatcher::clear_listeners_at(const coord_def &pos)
 {
     grid_triggers[pos.x][pos.y].reset(nullptr);
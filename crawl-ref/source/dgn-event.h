@@ -121,6 +121,8 @@ public:
                            const coord_def &pos = coord_def());
     void remove_listener(dgn_event_listener *,
                          const coord_def &pos = coord_def());
+
+    void swap(dgn_event_dispatcher &other);
 private:
     void register_listener_at(unsigned mask, const coord_def &pos,
                               dgn_event_listener *l);
@@ -8,6 +8,7 @@
 #include "map-cell.h"
 #include "monster.h"
 #include "trap-def.h"
+#include "unwind.h"
 
 typedef FixedArray<short, GXM, GYM> grid_heightmap;
 
@@ -132,10 +133,26 @@ struct crawl_environment
     string placing_vault;
 };
 
-#ifdef DEBUG_GLOBALS
+// `env` is the environment being worked on. This is the game's own
+// environment unless an env_activator has pointed it at a private one, e.g.
+// to build a level without touching the current level.
 #define env (*real_env)
-#endif
-extern struct crawl_environment env;
+extern crawl_environment *real_env;
+
+/**
+ * Make `env` refer to another crawl_environment for as long as this object
+ * lives. Everything that goes through `env` (and so menv, grd, mgrd, igrd),
+ * including the dungeon builder, vault placement and the dgn Lua bindings,
+ * then works on that environment instead.
+ */
+class env_activator
+{
+public:
+    explicit env_activator(crawl_environment &e) : prev(real_env, &e) { }
+
+private:
+    unwind_var<crawl_environment *> prev;
+};
 
 /**
  * Range proxy to iterate over only "real" menv slots, skipping anon slots.
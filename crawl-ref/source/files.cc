@@ -54,11 +54,13 @@
 #include "kills.h"
 #include "level-state-type.h"
 #include "libutil.h"
+#include "losglobal.h"
 #include "macro.h"
 #include "mapmark.h"
 #include "message.h"
 #include "mon-behv.h"
 #include "mon-death.h"
+#include "mon-movetarget.h"
 #include "mon-place.h"
 #include "notes.h"
 #include "place.h"
@@ -71,6 +73,7 @@
 #include "syscalls.h"
 #include "teleport.h"
 #include "terrain.h"
+#include "threads.h"
 #ifdef USE_TILE
  // TODO -- dolls
  #include "rltiles/tiledef-player.h"
@@ -126,7 +129,7 @@ static bool _convert_obsolete_species();
 
 const short GHOST_SIGNATURE = short(0xDC55);
 
-const int GHOST_LIMIT = 27; // max number of ghost files per level
+const int GHOST_LIMIT = 27; // max number of ghost entries per level
 
 static void _redraw_all()
 {
@@ -671,7 +674,6 @@ string savedir_versioned_path(const string &shortpath)
     return catpath(versioned_dir, shortpath);
 }
 
-#ifdef USE_TILE
 #define LINEMAX 1024
 static bool _readln(chunk_reader &rd, char *buf)
 {
@@ -687,7 +689,8 @@ static bool _readln(chunk_reader &rd, char *buf)
     return true;
 }
 
-static void _fill_player_doll(player_save_info &p, package *save)
+#ifdef USE_TILE
+static void _fill_player_doll(player_save_info &p, const string &line)
 {
     dolls_data equip_doll;
     for (unsigned int j = 0; j < TILEP_PART_MAX; ++j)
@@ -696,20 +699,14 @@ static void _fill_player_doll(player_save_info &p, package *save)
     equip_doll.parts[TILEP_PART_BASE]
         = tilep_species_to_base_tile(p.species, p.experience_level);
 
-    bool success = false;
-
-    chunk_reader fdoll(save, "tdl");
+    if (!line.empty())
     {
-        char fbuf[LINEMAX];
-        if (_readln(fdoll,fbuf))
-        {
-            tilep_scan_parts(fbuf, equip_doll, p.species, p.experience_level);
-            tilep_race_default(p.species, p.experience_level, &equip_doll);
-            success = true;
-        }
+        string parts = line;
+        tilep_scan_parts(&parts[0], equip_doll, p.species,
+                         p.experience_level);
+        tilep_race_default(p.species, p.experience_level, &equip_doll);
     }
-
-    if (!success) // Use default doll instead.
+    else // Use default doll instead.
     {
         job_type job = get_job_by_name(p.class_name.c_str());
         if (job == JOB_UNKNOWN)
@@ -721,6 +718,312 @@ static void _fill_player_doll(player_save_info &p, package *save)
 }
 #endif
 
+/*
+ * The save index.
+ *
+ * Each save directory keeps a small file caching what the save browser
+ * shows of every save in it, so that listing saves needn't open and
+ * inflate every package. A game appends a record for its save each time it
+ * commits; the newest record for a save wins, and is only believed while
+ * the save's size and modification time still match it, and only by the
+ * version of crawl that wrote it. Anything else is read from the save
+ * itself, and the start menu then rewrites the index without dead records.
+ */
+#define SAVE_INDEX_FILE "saves.idx"
+#define SAVE_INDEX_MAGIC 0x32444953 // "SID2"
+#define SAVE_INDEX_MAX_RECORD 65536
+
+// A record is trusted while its save's size, modification time and inode
+// are unchanged.
+struct save_index_entry
+{
+    int64_t size;
+    int64_t mtime;  // in nanoseconds, where the platform keeps them
+    uint64_t inode;
+    vector<unsigned char> info;
+};
+
+static void _set_save_index_stat(save_index_entry &entry,
+                                 const struct stat &st)
+{
+    entry.size = st.st_size;
+#if defined(TARGET_OS_WINDOWS)
+    entry.mtime = (int64_t)st.st_mtime * 1000000000;
+#elif defined(TARGET_OS_MACOSX)
+    entry.mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000
+                  + st.st_mtimespec.tv_nsec;
+#else
+    entry.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000
+                  + st.st_mtim.tv_nsec;
+#endif
+    entry.inode = st.st_ino;
+}
+
+// A checkpoint and the exit save often land in the same second with the
+// same size, so seconds alone would keep a stale record.
+static bool _save_index_current(const save_index_entry &entry,
+                                const struct stat &st)
+{
+    save_index_entry now;
+    _set_save_index_stat(now, st);
+    return entry.size == now.size && entry.mtime == now.mtime
+           && entry.inode == now.inode;
+}
+
+typedef map<string, save_index_entry> save_index;
+
+static void _marshall_save_info(writer &th, const player_save_info &p,
+                                bool has_doll, const string &doll)
+{
+    marshallUByte(th, TAG_MAJOR_VERSION);
+    marshallUByte(th, TAG_MINOR_VERSION);
+    marshallBoolean(th, p.save_loadable);
+    marshallString(th, p.name);
+    marshallInt(th, p.experience);
+    marshallInt(th, p.experience_level);
+    marshallBoolean(th, p.wizard);
+    marshallShort(th, p.species);
+    marshallString(th, p.species_name);
+    marshallString(th, p.class_name);
+    marshallShort(th, p.religion);
+    marshallString(th, p.god_name);
+    marshallString(th, p.jiyva_second_name);
+    marshallUByte(th, p.saved_game_type);
+    marshallBoolean(th, has_doll);
+    marshallString(th, doll);
+}
+
+// Returns false if the record was written by another version of crawl,
+// which may judge the save differently.
+static bool _unmarshall_save_info(reader &th, player_save_info &p)
+{
+    const uint8_t major = unmarshallUByte(th);
+    const uint8_t minor = unmarshallUByte(th);
+    if (major != TAG_MAJOR_VERSION || minor != TAG_MINOR_VERSION)
+        return false;
+
+    p.save_loadable     = unmarshallBoolean(th);
+    p.name              = unmarshallString(th);
+    p.experience        = unmarshallInt(th);
+    p.experience_level  = unmarshallInt(th);
+    p.wizard            = unmarshallBoolean(th);
+    p.species           = static_cast<species_type>(unmarshallShort(th));
+    p.species_name      = unmarshallString(th);
+    p.class_name        = unmarshallString(th);
+    p.religion          = static_cast<god_type>(unmarshallShort(th));
+    p.god_name          = unmarshallString(th);
+    p.jiyva_second_name = unmarshallString(th);
+    p.saved_game_type   = static_cast<game_type>(unmarshallUByte(th));
+
+    const bool has_doll = unmarshallBoolean(th);
+    const string doll = unmarshallString(th);
+#ifdef USE_TILE
+    if (Options.tile_menu_icons && has_doll)
+        _fill_player_doll(p, doll);
+#else
+    UNUSED(has_doll);
+#endif
+    return true;
+}
+
+static vector<unsigned char> _save_index_name(const string &filename)
+{
+    vector<unsigned char> name;
+    writer namef(&name);
+    marshallString(namef, filename);
+    return name;
+}
+
+// name is the save's filename from _save_index_name(). That is marshalled
+// ahead, since marshallString() can die and this can run on the save's I/O
+// thread.
+static void _marshall_save_index_record(writer &th,
+                                        const vector<unsigned char> &name,
+                                        const save_index_entry &entry)
+{
+    vector<unsigned char> body = name;
+    writer bodyf(&body);
+    marshallSigned(bodyf, entry.size);
+    marshallSigned(bodyf, entry.mtime);
+    marshallUnsigned(bodyf, entry.inode);
+    bodyf.write(&entry.info[0], entry.info.size());
+
+    marshallInt(th, SAVE_INDEX_MAGIC);
+    marshallInt(th, body.size());
+    th.write(&body[0], body.size());
+}
+
+// Reads the index into entries, returning how many records it held, or -1
+// if it ends in a damaged record (such as one torn by a crash).
+static int _unmarshall_save_index(const vector<unsigned char> &data,
+                                  save_index &entries)
+{
+    reader th(data);
+    th.set_safe_read(true);
+    int records = 0;
+    try
+    {
+        while (th.valid())
+        {
+            if (unmarshallInt(th) != SAVE_INDEX_MAGIC)
+                return -1;
+            const int len = unmarshallInt(th);
+            if (len <= 0 || len > SAVE_INDEX_MAX_RECORD)
+                return -1;
+            vector<unsigned char> body(len);
+            th.read(&body[0], len);
+
+            reader bodyf(body);
+            bodyf.set_safe_read(true);
+            const string filename = unmarshallString(bodyf);
+            save_index_entry &entry = entries[filename];
+            entry.size = unmarshallSigned(bodyf);
+            entry.mtime = unmarshallSigned(bodyf);
+            entry.inode = unmarshallUnsigned(bodyf);
+            entry.info.clear();
+            while (bodyf.valid())
+                entry.info.push_back(bodyf.readByte());
+            ++records;
+        }
+    }
+    catch (short_read_exception &E)
+    {
+        return -1;
+    }
+    return records;
+}
+
+static void _read_fd(int fd, vector<unsigned char> &data)
+{
+    unsigned char buf[4096];
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        data.insert(data.end(), buf, buf + len);
+}
+
+/**
+ * Returns a function recording the current game in its save's index
+ * record. It is meant to run after the save has been committed, which
+ * may happen on the save's I/O thread, so it captures all it needs.
+ */
+static function<void()> _save_index_updater()
+{
+#ifdef DISABLE_SAVEGAME_LISTS
+    return function<void()>();
+#else
+    if (Options.no_save)
+        return function<void()>();
+
+    player_save_info p;
+    p = you;
+    p.save_loadable = true;
+
+    string doll;
+#ifdef USE_TILE
+    {
+        vector<unsigned char> dollbuf;
+        writer dollf(&dollbuf);
+        save_doll_file(dollf);
+        doll.assign(dollbuf.begin(), dollbuf.end());
+    }
+    const bool has_doll = true;
+#else
+    const bool has_doll = false;
+#endif
+
+    save_index_entry entry;
+    writer infof(&entry.info);
+    _marshall_save_info(infof, p, has_doll, doll);
+
+    const vector<unsigned char> name =
+        _save_index_name(get_save_filename(you.your_name));
+    const string save_path = get_savedir_filename(you.your_name);
+    const string index_path = _get_savedir_path(SAVE_INDEX_FILE);
+
+    return [=]() mutable
+    {
+        struct stat st;
+        if (stat(save_path.c_str(), &st))
+            return;
+        _set_save_index_stat(entry, st);
+
+        vector<unsigned char> record;
+        writer recordf(&record);
+        _marshall_save_index_record(recordf, name, entry);
+
+        int fd = open_u(index_path.c_str(),
+                        O_WRONLY|O_APPEND|O_CREAT|O_BINARY, 0666);
+        if (fd < 0)
+            return;
+        if (lock_file(fd, true, true))
+        {
+            // A short write leaves a torn record; undo it if we can. If
+            // not, readers stop there until the index is next rewritten.
+            const off_t end = lseek(fd, 0, SEEK_END);
+            if (write(fd, &record[0], record.size()) != (ssize_t)record.size()
+                && end >= 0)
+            {
+                const int ret = ftruncate(fd, end);
+                UNUSED(ret);
+            }
+            unlock_file(fd);
+        }
+        close(fd);
+    };
+#endif
+}
+
+#ifndef DISABLE_SAVEGAME_LISTS
+/**
+ * Rewrite the index with only the records for saves still present. Games
+ * may have appended records since we read it, so it is read again under
+ * the lock; a record of ours replaces one from the index only if it is
+ * not older.
+ */
+static void _rewrite_save_index(const string &index_path,
+                                const save_index &fresh,
+                                const set<string> &present)
+{
+    int fd = open_u(index_path.c_str(), O_RDWR|O_CREAT|O_BINARY, 0666);
+    if (fd < 0)
+        return;
+    if (!lock_file(fd, true, true))
+    {
+        close(fd);
+        return;
+    }
+
+    vector<unsigned char> data;
+    _read_fd(fd, data);
+    save_index entries;
+    _unmarshall_save_index(data, entries);
+
+    for (const auto &rec : fresh)
+    {
+        auto old = entries.find(rec.first);
+        if (old == entries.end() || old->second.mtime <= rec.second.mtime)
+            entries[rec.first] = rec.second;
+    }
+
+    data.clear();
+    writer outf(&data);
+    for (const auto &rec : entries)
+        if (present.count(rec.first))
+            _marshall_save_index_record(outf, _save_index_name(rec.first),
+                                        rec.second);
+
+    if (lseek(fd, 0, SEEK_SET)
+        || ftruncate(fd, 0)
+        || !data.empty()
+           && write(fd, &data[0], data.size()) != (ssize_t)data.size())
+    {
+        dprf("Failed to rewrite %s", index_path.c_str());
+    }
+    unlock_file(fd);
+    close(fd);
+}
+#endif
+
 /*
  * Returns a list of the names of characters that are already saved for the
  * current user.
@@ -739,34 +1042,104 @@ static vector<player_save_info> _find_saved_characters()
     if (searchpath.empty())
         searchpath = ".";
 
+    const string index_path = _get_savedir_path(SAVE_INDEX_FILE);
+    save_index index;
+    int records = 0;
+    int fd = open_u(index_path.c_str(), O_RDONLY|O_BINARY, 0666);
+    if (fd >= 0)
+    {
+        if (lock_file(fd, false, true))
+        {
+            vector<unsigned char> data;
+            _read_fd(fd, data);
+            records = _unmarshall_save_index(data, index);
+            unlock_file(fd);
+        }
+        close(fd);
+    }
+
+    save_index fresh;
+    set<string> present;
     for (const string &filename : get_dir_files_sorted(searchpath))
     {
-        if (is_save_file_name(filename))
+        if (!is_save_file_name(filename))
+            continue;
+
+        const string path = _get_savedir_path(filename);
+        struct stat st;
+        if (stat(path.c_str(), &st))
+            continue;
+        present.insert(filename);
+
+        auto entry = index.find(filename);
+        if (entry != index.end() && _save_index_current(entry->second, st))
         {
+            player_save_info p;
+            reader infof(entry->second.info);
+            infof.set_safe_read(true);
             try
             {
-                package save(_get_savedir_path(filename).c_str(), false);
-                player_save_info p = _read_character_info(&save);
-                if (!p.name.empty())
+                if (_unmarshall_save_info(infof, p))
                 {
-                    p.filename = filename;
-#ifdef USE_TILE
-                    if (Options.tile_menu_icons && save.has_chunk("tdl"))
-                        _fill_player_doll(p, &save);
-#endif
-                    chars.push_back(p);
+                    if (!p.name.empty())
+                    {
+                        p.filename = filename;
+                        chars.push_back(p);
+                    }
+                    continue;
                 }
             }
-            catch (ext_fail_exception &E)
+            catch (short_read_exception &E)
             {
-                dprf("%s: %s", filename.c_str(), E.what());
             }
-            catch (game_ended_condition &E) // another process is using the save
+        }
+
+        try
+        {
+            package save(path.c_str(), false);
+            player_save_info p = _read_character_info(&save);
+            if (p.name.empty())
+                continue;
+
+            string doll;
+            const bool has_doll = save.has_chunk("tdl");
+            if (has_doll)
             {
-                if (E.exit_reason != game_exit::abort)
-                    throw;
+                chunk_reader fdoll(&save, "tdl");
+                char fbuf[LINEMAX];
+                if (_readln(fdoll, fbuf))
+                    doll = fbuf;
             }
+
+            save_index_entry &rec = fresh[filename];
+            _set_save_index_stat(rec, st);
+            writer infof(&rec.info);
+            _marshall_save_info(infof, p, has_doll, doll);
+
+            p.filename = filename;
+#ifdef USE_TILE
+            if (Options.tile_menu_icons && has_doll)
+                _fill_player_doll(p, doll);
+#endif
+            chars.push_back(p);
+        }
+        catch (ext_fail_exception &E)
+        {
+            dprf("%s: %s", filename.c_str(), E.what());
         }
+        catch (game_ended_condition &E) // another process is using the save
+        {
+            if (E.exit_reason != game_exit::abort)
+                throw;
+        }
+    }
+
+    // Rewrite the index if it was damaged, missed saves, or has become
+    // mostly dead records.
+    if (records < 0 || !fresh.empty()
+        || records > 2 * (int)present.size() + 16)
+    {
+        _rewrite_save_index(index_path, fresh, present);
     }
 
     sort(chars.begin(), chars.end());
@@ -798,6 +1171,37 @@ vector<player_save_info> find_all_saved_characters()
     return saved_characters;
 }
 
+/**
+ * Apply the save_compression options to a save. An empty save takes the
+ * chosen codec; one with chunks keeps the codec it has, and only uses the
+ * chosen level if the codecs match. A level the codec doesn't accept falls
+ * back to the codec's default.
+ */
+void set_save_compression(package &save)
+{
+    save_codec codec = save_codec_by_name(Options.save_compression);
+    if (codec == NUM_SAVE_CODECS || !save_codec_available(codec))
+    {
+        mprf(MSGCH_ERROR, "Unsupported save_compression '%s', using zlib.",
+             Options.save_compression.c_str());
+        codec = SAVE_CODEC_ZLIB;
+    }
+
+    int level = Options.save_compression_level;
+    if (level > save_codec_max_level(codec))
+    {
+        mprf(MSGCH_ERROR, "save_compression_level %d is too high for %s "
+             "(at most %d), using its default.", level,
+             save_codec_name(codec), save_codec_max_level(codec));
+        level = 0;
+    }
+
+    if (save.list_chunks().empty())
+        save.set_codec(codec, level);
+    else if (save.get_codec() == codec)
+        save.set_codec(codec, level);
+}
+
 bool save_exists(const string& filename)
 {
     return file_exists(_get_savefile_directory() + filename);
@@ -849,10 +1253,8 @@ void write_ghost_version(writer &outf)
         marshallInt(outf, 0);
 }
 
-static void _write_tagged_chunk(const string &chunkname, tag_type tag)
+static void _marshall_tagged_chunk(writer &outf, tag_type tag)
 {
-    writer outf(you.save, chunkname);
-
     // write version
     marshallUByte(outf, TAG_MAJOR_VERSION);
     marshallUByte(outf, TAG_MINOR_VERSION);
@@ -860,6 +1262,295 @@ static void _write_tagged_chunk(const string &chunkname, tag_type tag)
     tag_write(tag, outf);
 }
 
+// Chunks marshalled for a checkpoint that the save's I/O thread will store;
+// null when chunks go straight into the save.
+static chunk_list *checkpoint_chunks = nullptr;
+
+static writer *_chunk_writer(const string &chunkname)
+{
+    if (!checkpoint_chunks)
+        return new writer(you.save, chunkname);
+
+    checkpoint_chunks->emplace_back(chunkname, vector<unsigned char>());
+    return new writer(&checkpoint_chunks->back().second);
+}
+
+static void _write_tagged_chunk(const string &chunkname, tag_type tag)
+{
+    unique_ptr<writer> outf(_chunk_writer(chunkname));
+    _marshall_tagged_chunk(*outf, tag);
+}
+
+/*
+ * Levels are saved in sections (see level_section_type), each in a chunk of
+ * its own: the level's chunk holds the header, and the rest go in chunks
+ * named after it. Each chunk is a version, then the length and bytes of its
+ * section. The package keeps a fingerprint of each section it holds in the
+ * current format, and a section whose fingerprint still matches is not
+ * written again; a stair-dancer's levels usually differ only in their
+ * header, monsters and a few other parts.
+ */
+static const char *level_section_suffixes[] =
+{
+    "", "+terrain", "+knowledge", "+features", "+items", "+monsters", "+tiles",
+};
+COMPILE_CHECK(ARRAYSZ(level_section_suffixes) == NUM_LEVEL_SECTIONS);
+
+static string _level_section_chunk(const string &chunkname, int section)
+{
+    return chunkname + level_section_suffixes[section];
+}
+
+// FNV-1a; the length goes in too, for good measure.
+static uint64_t _section_fingerprint(const unsigned char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    return hash ^ len;
+}
+
+/**
+ * Marshall the current level, and pick out the sections that differ from
+ * what the save holds.
+ *
+ * @param chunkname     The level's chunk.
+ * @param[out] chunks   The chunks to write, ready for the package.
+ * @param[out] prints   The fingerprint of each of those chunks, to be
+ *                      given to the package once it has been written.
+ */
+static void _level_section_chunks(const string &chunkname,
+                                   chunk_list &chunks,
+                                   vector<uint64_t> &prints)
+{
+    vector<unsigned char> data;
+    vector<size_t> starts;
+    tag_write_level_sections(data, starts);
+
+    for (int i = 0; i < NUM_LEVEL_SECTIONS; ++i)
+    {
+        const size_t start = starts[i];
+        const size_t len = (i + 1 < NUM_LEVEL_SECTIONS ? starts[i + 1]
+                                                       : data.size())
+                           - start;
+        const string name = _level_section_chunk(chunkname, i);
+        const uint64_t print = _section_fingerprint(data.data() + start, len);
+
+        uint64_t stored;
+        if (you.save->get_fingerprint(name, stored) && stored == print)
+            continue;
+
+        chunks.emplace_back(name, vector<unsigned char>());
+        writer outf(&chunks.back().second);
+        marshallUByte(outf, TAG_MAJOR_VERSION);
+        marshallUByte(outf, TAG_MINOR_VERSION);
+        marshallInt(outf, len);
+        outf.write(data.data() + start, len);
+        prints.push_back(print);
+    }
+}
+
+static void _write_level_chunks(const string &chunkname)
+{
+    chunk_list chunks;
+    vector<uint64_t> prints;
+    _level_section_chunks(chunkname, chunks, prints);
+
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        {
+            unique_ptr<writer> outf(_chunk_writer(chunks[i].first));
+            outf->write(chunks[i].second.data(), chunks[i].second.size());
+        }
+        you.save->set_fingerprint(chunks[i].first, prints[i]);
+    }
+}
+
+/**
+ * Read a level saved in sections. The level's own chunk, inf, has had its
+ * version read already; the sections are put back together and read as
+ * one TAG_LEVEL tag.
+ */
+static void _read_level_sections(package *save, const string &chunkname,
+                                 reader &inf)
+{
+    const int minor = inf.getMinorVersion();
+    vector<unsigned char> data(sizeof(int32_t)); // the tag's length, later
+
+    for (int i = 0; i < NUM_LEVEL_SECTIONS; ++i)
+    {
+        const string name = _level_section_chunk(chunkname, i);
+        unique_ptr<reader> sectionf;
+        reader *secf = &inf;
+        if (i != LEVEL_SECTION_HEADER)
+        {
+            sectionf.reset(new reader(save, name));
+            secf = sectionf.get();
+            const uint8_t major = unmarshallUByte(*secf);
+            if (major != TAG_MAJOR_VERSION || unmarshallUByte(*secf) != minor)
+                fail("level section %s is out of step", name.c_str());
+        }
+
+        const int len = unmarshallInt(*secf);
+        if (len < 0)
+            fail("level section %s is corrupt", name.c_str());
+        const size_t start = data.size();
+        data.resize(start + len);
+        if (len)
+            secf->read(&data[start], len);
+        if (sectionf)
+            sectionf->fail_if_not_eof(name);
+
+        // Fingerprints are only good for sections we'd write the same way.
+        if (minor == TAG_MINOR_VERSION)
+        {
+            save->set_fingerprint(name,
+                _section_fingerprint(data.data() + start, len));
+        }
+    }
+
+    vector<unsigned char> length;
+    writer lengthf(&length);
+    marshallInt(lengthf, data.size() - sizeof(int32_t));
+    copy(length.begin(), length.end(), data.begin());
+
+    reader th(data, minor);
+    tag_read(th, TAG_LEVEL);
+}
+
+/**
+ * Overlaps the compression of freshly built levels with building the next
+ * one during pregeneration.
+ *
+ * The levels themselves are built one at a time on the main thread: the
+ * builder shares `you` (unique and vault bookkeeping), dlua and the levelgen
+ * RNGs, and the order levels are built in is part of what makes a seed
+ * reproducible. What can safely run elsewhere is compressing a finished
+ * level, which a worker thread does while the main thread carries on. The
+ * chunks are committed to the save strictly in build order, and compress to
+ * exactly the bytes a direct write would produce, so the save is identical
+ * to one from a serial pregen.
+ */
+class level_write_pipeline
+{
+public:
+    level_write_pipeline() : in_flight(nullptr) { }
+    ~level_write_pipeline();
+
+    void write(const string &chunkname);
+    bool pending(const string &chunkname) const;
+    void flush();
+
+private:
+    struct compress_job
+    {
+        string name;
+        chunk_list chunks;
+        vector<uint64_t> prints;
+        vector<vector<unsigned char> > zdata;
+        save_codec codec;
+        int level;
+        string error;
+    };
+
+    static void *_compress(void *arg);
+    void store(const compress_job &job);
+
+    compress_job *in_flight;
+    thread_t worker;
+};
+
+static level_write_pipeline *pregen_pipeline = nullptr;
+
+void *level_write_pipeline::_compress(void *arg)
+{
+    compress_job *job = static_cast<compress_job *>(arg);
+    try
+    {
+        job->zdata.resize(job->chunks.size());
+        for (size_t i = 0; i < job->chunks.size(); ++i)
+        {
+            compress_chunk_data(job->chunks[i].second, job->zdata[i],
+                                job->codec, job->level);
+        }
+    }
+    catch (exception &e)
+    {
+        // Errors are reported on the main thread, when the job is collected.
+        job->error = e.what();
+    }
+    return nullptr;
+}
+
+level_write_pipeline::~level_write_pipeline()
+{
+    // Only reached without a flush() if the build was interrupted; whatever
+    // is still compressing is dropped, just as an unsaved level would be.
+    if (in_flight)
+    {
+        thread_join(worker);
+        delete in_flight;
+    }
+}
+
+/// Marshall the current level and start compressing it in the background.
+void level_write_pipeline::write(const string &chunkname)
+{
+    flush();
+
+    unique_ptr<compress_job> job(new compress_job);
+    job->name = chunkname;
+    job->codec = you.save->get_codec();
+    job->level = you.save->get_codec_level();
+    _level_section_chunks(chunkname, job->chunks, job->prints);
+
+    if (thread_create_joinable(&worker, _compress, job.get()))
+    {
+        // No thread to be had: just do the work here.
+        _compress(job.get());
+        store(*job);
+        return;
+    }
+    in_flight = job.release();
+}
+
+/// Is this chunk built, but not yet stored in the save?
+bool level_write_pipeline::pending(const string &chunkname) const
+{
+    return in_flight && in_flight->name == chunkname;
+}
+
+/// Wait for any level still being compressed, and store it in the save.
+void level_write_pipeline::flush()
+{
+    if (!in_flight)
+        return;
+
+    thread_join(worker);
+    unique_ptr<compress_job> job(in_flight);
+    in_flight = nullptr;
+
+    store(*job);
+}
+
+void level_write_pipeline::store(const compress_job &job)
+{
+    if (!job.error.empty())
+        fail("%s", job.error.c_str());
+    for (size_t i = 0; i < job.chunks.size(); ++i)
+    {
+        you.save->write_compressed_chunk(job.chunks[i].first, job.zdata[i]);
+        you.save->set_fingerprint(job.chunks[i].first, job.prints[i]);
+    }
+}
+
+/// Does the save contain this level, or is it about to?
+static bool _level_chunk_exists(const string &chunkname)
+{
+    return you.save->has_chunk(chunkname)
+           || pregen_pipeline && pregen_pipeline->pending(chunkname);
+}
+
 static int _get_dest_stair_type(dungeon_feature_type stair_taken,
                                 bool &find_first)
 {
@@ -1308,6 +1999,10 @@ bool player::level_visited(const level_id &level)
     return visited.exists(level.describe());
 }
 
+// Whether generate_level() is building a level next to the player's live
+// one; see speculative_pregen().
+static bool _building_speculatively = false;
+
 static void _generic_level_reset()
 {
     // TODO: can more be pulled into here?
@@ -1318,6 +2013,7 @@ static void _generic_level_reset()
     // Lose all listeners.
     dungeon_events.clear();
     clear_travel_trail();
+    clear_shared_paths();
 }
 
 
@@ -1414,7 +2110,7 @@ static bool _generate_portal_levels()
 bool generate_level(const level_id &l)
 {
     const string level_name = l.describe();
-    if (you.save->has_chunk(level_name))
+    if (_level_chunk_exists(level_name))
         return false;
 
     unwind_var<int> depth(you.depth, l.depth);
@@ -1437,7 +2133,15 @@ bool generate_level(const level_id &l)
 
     _generic_level_reset();
     delete_all_clouds();
-    los_changed(); // invalidate the los cache, which impacts monster placement
+    // invalidate the los cache, which impacts monster placement
+    if (_building_speculatively)
+    {
+        // Leave the monsters just seen on the player's level alone.
+        invalidate_los();
+        invalidate_agrid();
+    }
+    else
+        los_changed();
 
     // initialize env for builder
     env.turns_on_level = -1;
@@ -1483,7 +2187,7 @@ bool generate_level(const level_id &l)
     if (_generate_portal_levels())
     {
         // if portals were generated, we're currently elsewhere.
-        ASSERT(you.save->has_chunk(save_name));
+        ASSERT(_level_chunk_exists(save_name));
         dprf("Reloading new level '%s'.", save_name.c_str());
         _restore_tagged_chunk(you.save, save_name, TAG_LEVEL,
             "Level file is invalid.");
@@ -1535,32 +2239,12 @@ static bool _branch_pregenerates(branch_type b)
         branch_generation_order.end(), b) > 0;
 }
 
-/**
-* Generate dungeon branches in a stable order until the level `stopping_point`
-* is found; `stopping_point` will be generated if it doesn't already exist. If
-* it does exist, the function is a noop.
-*
-* If `stopping_point` is not in the generation order, it will be generated on
-* its own.
-*
-* To generate all generatable levels, pass a level_id with NUM_BRANCHES as the
-* branch.
-*/
-bool pregen_dungeon(const level_id &stopping_point)
-{
-    // TODO: the is_valid() check here doesn't look quite right to me, but so
-    // far I can't get it to break anything...
-    if (stopping_point.is_valid()
-        || stopping_point.branch != NUM_BRANCHES &&
-           is_random_subbranch(stopping_point.branch) && you.wizard)
-    {
-        if (you.save->has_chunk(stopping_point.describe()))
-            return false;
-
-        if (!_branch_pregenerates(stopping_point.branch))
-            return generate_level(stopping_point);
-    }
-
+/**
+ * List the levels that pregen_dungeon() would build, in order, to reach
+ * `stopping_point` in the branch generation order.
+ */
+static vector<level_id> _levels_to_pregenerate(const level_id &stopping_point)
+{
     vector<level_id> to_generate;
     bool at_end = false;
     for (auto br : branch_generation_order)
@@ -1602,6 +2286,37 @@ bool pregen_dungeon(const level_id &stopping_point)
         if (at_end)
             break;
     }
+    return to_generate;
+}
+
+/**
+* Generate dungeon branches in a stable order until the level `stopping_point`
+* is found; `stopping_point` will be generated if it doesn't already exist. If
+* it does exist, the function is a noop.
+*
+* If `stopping_point` is not in the generation order, it will be generated on
+* its own.
+*
+* To generate all generatable levels, pass a level_id with NUM_BRANCHES as the
+* branch.
+*/
+bool pregen_dungeon(const level_id &stopping_point)
+{
+    // TODO: the is_valid() check here doesn't look quite right to me, but so
+    // far I can't get it to break anything...
+    if (stopping_point.is_valid()
+        || stopping_point.branch != NUM_BRANCHES &&
+           is_random_subbranch(stopping_point.branch) && you.wizard)
+    {
+        if (_level_chunk_exists(stopping_point.describe()))
+            return false;
+
+        if (!_branch_pregenerates(stopping_point.branch))
+            return generate_level(stopping_point);
+    }
+
+    const vector<level_id> to_generate =
+        _levels_to_pregenerate(stopping_point);
 
     if (to_generate.size() == 0)
     {
@@ -1618,6 +2333,10 @@ bool pregen_dungeon(const level_id &stopping_point)
         ui::progress_popup progress("Generating dungeon...\n\n", 35);
         progress.advance_progress();
 
+        // Compress each level while the next one is being built.
+        level_write_pipeline pipeline;
+        unwind_var<level_write_pipeline *> active(pregen_pipeline, &pipeline);
+
         // in normal usage if we get to here, something will generate. But it
         // is possible to call this in a way that doesn't lead to generation.
         bool generated = false;
@@ -1646,11 +2365,114 @@ bool pregen_dungeon(const level_id &stopping_point)
             progress.advance_progress();
             generated = generate_level(new_level) || generated;
         }
+        pipeline.flush();
 
         return generated;
     }
 }
 
+/**
+ * Build `dest` without disturbing the level the player is on.
+ *
+ * The player's level stays live in the main environment while the builder
+ * works in a scratch one. generate_level() stores the result in the save, so
+ * taking the stairs later just loads it.
+ */
+static void _pregen_speculatively(const level_id &dest)
+{
+    dprf("Speculatively building %s.", dest.describe().c_str());
+
+    unique_ptr<crawl_environment> scratch(new crawl_environment);
+    {
+        env_activator building(*scratch);
+        unwind_bool speculative(_building_speculatively, true);
+
+        // Keep the current level's listeners and targets away from the
+        // builder's level reset.
+        dgn_event_dispatcher events;
+        dungeon_events.swap(events);
+        unwinder restore_events([&events]() { dungeon_events.swap(events); });
+        unwind_var<unsigned short> prev_targ(you.prev_targ);
+        unwind_var<coord_def> prev_grd_targ(you.prev_grd_targ);
+
+        generate_level(dest);
+    }
+
+    // The builder filled the LOS and area caches from the new level.
+    invalidate_los();
+    invalidate_agrid(true);
+
+#ifdef USE_TILE
+    // ...and told the minimap about its cells.
+    for (rectangle_iterator ri(0); ri; ++ri)
+        tiles.update_minimap(*ri);
+#endif
+}
+
+// How long the player must leave the keyboard alone before a speculative
+// build starts, in milliseconds.
+#define SPECULATIVE_PREGEN_IDLE 500
+
+/**
+ * Wait for up to `ms` milliseconds for the player to press a key.
+ *
+ * @return whether none was pressed.
+ */
+static bool _player_idle_for(int ms)
+{
+    update_screen();
+    return !has_pending_input() && !kbhit_within(ms);
+}
+
+/**
+ * If the player is near an unvisited downstair, build the level it leads to
+ * once they have been idle for SPECULATIVE_PREGEN_IDLE ms, rather than when
+ * the stairs are taken.
+ *
+ * This is not asynchronous: the build runs on the main thread and can't be
+ * interrupted, so a key pressed during it waits until it is done. Waiting
+ * for the player to go idle first only makes that less likely.
+ *
+ * This only ever builds the level that incremental pregeneration would build
+ * next anyway, from its own levelgen RNG, so it changes when the work is done
+ * but not its result, and never touches the gameplay RNG. A level that ends
+ * up not being entered right away is simply kept until it is.
+ */
+void speculative_pregen()
+{
+    if (!Options.speculative_pregen || !you.deterministic_levelgen
+        || !you.save || !crawl_state.game_is_normal())
+    {
+        return;
+    }
+
+    for (radius_iterator ri(you.pos(), 2, C_SQUARE, LOS_NO_TRANS); ri; ++ri)
+    {
+        const dungeon_feature_type feat = grd(*ri);
+        if (feat_stair_direction(feat) != CMD_GO_DOWNSTAIRS
+            || feat_is_portal_entrance(feat) || feature_mimic_at(*ri))
+        {
+            continue;
+        }
+
+        const level_id dest = stair_destination(*ri);
+        if (!dest.is_valid() || !_branch_pregenerates(dest.branch)
+            || is_existing_level(dest))
+        {
+            continue;
+        }
+
+        // Anything else would build levels out of order.
+        const vector<level_id> todo = _levels_to_pregenerate(dest);
+        if (todo.size() != 1 || todo[0] != dest)
+            continue;
+
+        if (_player_idle_for(SPECULATIVE_PREGEN_IDLE))
+            _pregen_speculatively(dest);
+        return;
+    }
+}
+
 /**
  * Load the current level.
  *
@@ -2002,7 +2824,10 @@ static void _save_level(const level_id& lid)
     // Nail all items to the ground.
     fix_item_coordinates();
 
-    _write_tagged_chunk(lid.describe(), TAG_LEVEL);
+    if (pregen_pipeline)
+        pregen_pipeline->write(lid.describe());
+    else
+        _write_level_chunks(lid.describe());
 }
 
 #if TAG_MAJOR_VERSION == 34
@@ -2011,11 +2836,11 @@ static void _save_level(const level_id& lid)
 # define CHUNK(short, long) long
 #endif
 
-#define SAVEFILE(short, long, savefn)           \
-    do                                          \
-    {                                           \
-        writer w(you.save, CHUNK(short, long)); \
-        savefn(w);                              \
+#define SAVEFILE(short, long, savefn)                            \
+    do                                                           \
+    {                                                            \
+        unique_ptr<writer> w(_chunk_writer(CHUNK(short, long))); \
+        savefn(*w);                                              \
     } while (false)
 
 // Stack allocated string's go in separate function, so Valgrind doesn't
@@ -2079,8 +2904,12 @@ static void _save_game_exit()
     tiles.send_exit_reason("saved");
 #endif
 
+    // Deleting the package commits it.
+    const function<void()> update_index = _save_index_updater();
     delete you.save;
     you.save = 0;
+    if (update_index)
+        update_index();
 }
 
 void save_game(bool leave_game, const char *farewellmsg)
@@ -2102,18 +2931,30 @@ void save_game(bool leave_game, const char *farewellmsg)
 #endif
     }
 
-    // Stack allocated string's go in separate function,
-    // so Valgrind doesn't complain.
-    _save_game_base();
-
     // If just save, early out.
     if (!leave_game)
     {
-        if (!crawl_state.disables[DIS_SAVE_CHECKPOINTS])
-            you.save->commit();
+        if (crawl_state.disables[DIS_SAVE_CHECKPOINTS])
+        {
+            _save_game_base();
+            return;
+        }
+
+        // Marshall everything into memory now, and let the save's I/O
+        // thread compress, write and sync it while play goes on.
+        chunk_list chunks;
+        {
+            unwind_var<chunk_list *> batch(checkpoint_chunks, &chunks);
+            _save_game_base();
+        }
+        you.save->commit_async(chunks, _save_index_updater());
         return;
     }
 
+    // Stack allocated string's go in separate function,
+    // so Valgrind doesn't complain.
+    _save_game_base();
+
     // Stack allocated string's go in separate function,
     // so Valgrind doesn't complain.
     _save_game_exit();
@@ -2145,14 +2986,18 @@ static bool _bones_save_individual_levels(bool store)
                      player_in_branch(BRANCH_SLIME));
 }
 
-static string _make_ghost_filename(bool store=false)
+static string _bones_place(bool store=false)
 {
     const bool with_number = _bones_save_individual_levels(store);
     // Players die so rarely in hell in practice that it doesn't even make
     // sense to have per-hell bones. (Maybe vestibule should be separate?)
-    const string level_desc = player_in_hell(true) ? "Hells" :
+    return player_in_hell(true) ? "Hells" :
         replace_all(level_id::current().describe(false, with_number), ":", "-");
-    return string("bones.") + (store ? "store." : "") + level_desc;
+}
+
+static string _make_ghost_filename(bool store=false)
+{
+    return string("bones.") + (store ? "store." : "") + _bones_place(store);
 }
 
 static string _bones_permastore_file()
@@ -2220,49 +3065,315 @@ static string _bones_permastore_file()
 // if they are on the floor where the player dies. The permastore is a more
 // permanent stock of ghosts (per level) to use as a backup in case the
 // temporary bones files are depleted.
+//
+// Ephemeral ghosts are kept together in a single package in the bones
+// directory, with a chunk per place (named as by _bones_place()). A chunk
+// is a bones header, then up to GHOST_LIMIT entries, each holding the
+// ghosts saved by one death. Taking or adding ghosts reads and rewrites
+// that one small chunk, without listing the bones directory; the package
+// reuses freed space itself. Processes take turns through a lock file, and
+// a crash mid-update leaves the package as it was at its last commit.
+
+typedef vector<vector<unsigned char> > bones_entries;
 
 /**
- * Lists all bonefiles for the current level.
- *
- * @return A vector containing absolute paths to 0+ bonefiles.
+ * Move bones files from before the bones package into it. This is done
+ * once, when the package is created.
  */
-static vector<string> _list_bones()
+static void _import_bone_files(package &store)
 {
-    string bonefile_dir = _get_bonefile_directory();
-    string base_filename = _make_ghost_filename();
-    string underscored_filename = base_filename + "_";
+    vector<pair<string, string> > files; // (path, place)
+    const string bone_dir = _get_bonefile_directory();
+    for (const string &filename : get_dir_files_sorted(bone_dir))
+    {
+        const size_t underscore = filename.rfind('_');
+        if (!starts_with(filename, "bones.")
+            || starts_with(filename, "bones.store.")
+            || ends_with(filename, ".backup")
+            || underscore == string::npos)
+        {
+            continue;
+        }
+        files.emplace_back(bone_dir + filename,
+                           filename.substr(6, underscore - 6));
+    }
+
+    const string old_dir = _get_old_bonefile_directory();
+    for (const string &filename : get_dir_files_sorted(old_dir))
+        if (starts_with(filename, "bones."))
+            files.emplace_back(old_dir + filename, filename.substr(6));
+
+    map<string, bones_entries> places;
+    for (const auto &file : files)
+    {
+        try
+        {
+            const vector<ghost_demon> ghosts = load_bones_file(file.first);
+            bones_entries &entries = places[file.second];
+            if (!ghosts.empty() && entries.size() < (size_t)GHOST_LIMIT)
+            {
+                entries.emplace_back();
+                writer outw(&entries.back());
+                tag_write_ghosts(outw, ghosts);
+            }
+        }
+        catch (corrupted_save &err)
+        {
+            // Left for whichever version can read it.
+            _ghost_dprf("Not importing %s: %s", file.first.c_str(), err.what());
+            continue;
+        }
+        if (unlink(file.first.c_str()) != 0)
+        {
+            mprf(MSGCH_ERROR, "Failed to unlink bones file: %s",
+                 file.first.c_str());
+        }
+    }
 
-    vector<string> filenames = get_dir_files_sorted(bonefile_dir);
-    vector<string> bonefiles;
-    for (const auto &filename : filenames)
-        if (starts_with(filename, underscored_filename)
-                                            && !ends_with(filename, ".backup"))
+    for (const auto &place : places)
+    {
+        if (place.second.empty())
+            continue;
+        writer outw(&store, place.first);
+        write_ghost_version(outw);
+        marshallShort(outw, place.second.size());
+        for (const auto &entry : place.second)
         {
-            bonefiles.push_back(bonefile_dir + filename);
-            _ghost_dprf("bonesfile %s", (bonefile_dir + filename).c_str());
+            marshallInt(outw, entry.size());
+            outw.write(&entry[0], entry.size());
         }
+    }
+}
+
+/**
+ * Exclusive use of the bones package, for as long as this lives.
+ * The package is committed before the lock is let go.
+ */
+class bones_store
+{
+public:
+    bones_store();
+    ~bones_store();
+
+    package *store;
 
-    string old_bonefile = _get_old_bonefile_directory() + base_filename;
-    if (access(old_bonefile.c_str(), F_OK) == 0)
+private:
+    void drop_store();
+
+    FILE *lock;
+};
+
+bones_store::bones_store() : store(nullptr), lock(nullptr)
+{
+    const string path = _get_bonefile_directory() + BONES_STORE_FILE;
+    lock = lk_open("a", path + ".lock");
+    if (!lock)
+    {
+        _ghost_dprf("Could not lock the bones package.");
+        return;
+    }
+
+    try
+    {
+        if (file_exists(path))
+            store = new package(path.c_str(), true);
+        else
+        {
+            store = new package(path.c_str(), true, true);
+            _import_bone_files(*store);
+        }
+    }
+    catch (corrupted_save &E)
+    {
+        // Keep a broken package for inspection; a fresh one will be
+        // started next time.
+        if (store)
+        {
+            drop_store();
+            mprf(MSGCH_ERROR, "Could not set up bones package %s: %s",
+                 path.c_str(), E.what());
+            return;
+        }
+        const string bad = path + ".bad";
+        mprf(MSGCH_ERROR, "Moving bad bones package %s aside to %s: %s",
+             path.c_str(), bad.c_str(), E.what());
+        if (rename_u(path.c_str(), bad.c_str()))
+            mprf(MSGCH_ERROR, "Could not move %s aside.", path.c_str());
+    }
+    catch (ext_fail_exception &E)
+    {
+        // Most likely an I/O error: leave every ghost where it is.
+        drop_store();
+        mprf(MSGCH_ERROR, "Could not open bones package %s: %s", path.c_str(),
+             E.what());
+    }
+    catch (game_ended_condition &E) // held by something not using the lock
     {
-        _ghost_dprf("Found old bonefile %s", old_bonefile.c_str());
-        bonefiles.push_back(old_bonefile);
+        if (E.exit_reason != game_exit::abort)
+            throw;
+        drop_store();
+        _ghost_dprf("The bones package is in use.");
     }
+}
+
+/**
+ * Let go of a package that failed while being set up. Opening an existing
+ * package either succeeds or leaves store unset, so this only ever throws
+ * away a fresh package that had yet to be committed.
+ */
+void bones_store::drop_store()
+{
+    if (!store)
+        return;
+    store->unlink();
+    delete store;
+    store = nullptr;
+}
 
-    return bonefiles;
+bones_store::~bones_store()
+{
+    delete store;
+    lk_close(lock);
 }
 
 /**
- * Attempts to find a file containing ghost(s) appropriate for the player.
+ * Split a place's chunk into its entries, as they are stored. Throws
+ * short_read_exception if the chunk is broken or from an incompatible
+ * version.
  *
- * @return The filename of an appropriate bones file; may be "".
+ * @return the chunk's bones version.
  */
-static string _find_ghost_file()
+static save_version _parse_bones_entries(package &store, const string &place,
+                                         bones_entries &entries)
 {
-    vector<string> bonefiles = _list_bones();
-    if (bonefiles.empty())
-        return "";
-    return bonefiles[random2(bonefiles.size())];
+    entries.clear();
+    reader inf(&store, place);
+    inf.set_safe_read(true);
+    const save_version version = read_ghost_header(inf);
+    if (version.valid() && version.is_future())
+        return version;
+    if (!_ghost_version_compatible(version))
+        throw short_read_exception();
+
+    const int count = unmarshallShort(inf);
+    for (int i = 0; i < count; ++i)
+    {
+        const int len = unmarshallInt(inf);
+        if (len <= 0)
+            throw short_read_exception();
+        entries.emplace_back(len);
+        inf.read(&entries.back()[0], len);
+    }
+    inf.fail_if_not_eof(place);
+    return version;
+}
+
+/**
+ * Read the ghosts stored for a place, bringing them up to the current
+ * bones version if need be. A chunk that is broken, or too old to use, is
+ * dropped.
+ *
+ * @return false if the place's ghosts are from a newer version, and should
+ *         be left alone.
+ */
+static bool _read_bones_entries(package &store, const string &place,
+                                bones_entries &entries)
+{
+    entries.clear();
+    if (!store.has_chunk(place))
+        return true;
+
+    save_version version;
+    try
+    {
+        version = _parse_bones_entries(store, place, entries);
+        if (version.is_future())
+            return false;
+    }
+    catch (short_read_exception &E)
+    {
+        mprf(MSGCH_ERROR, "Clearing bad ghosts for %s in the bones package.",
+             place.c_str());
+        entries.clear();
+        store.delete_chunk(place);
+        return true;
+    }
+
+    if (version < save_version::current_bones())
+    {
+        for (auto &entry : entries)
+        {
+            reader inf(entry, version.minor);
+            const vector<ghost_demon> ghosts = tag_read_ghosts(inf);
+            entry.clear();
+            writer outw(&entry);
+            tag_write_ghosts(outw, ghosts);
+        }
+    }
+    return true;
+}
+
+/**
+ * All the ghosts in a bones package, by place, for the bones command-line
+ * tools. This only reads the package: places that are broken or from
+ * another version are reported and skipped rather than cleared.
+ */
+map<string, vector<ghost_demon>> load_bones_store(const string &filename)
+{
+    map<string, vector<ghost_demon>> places;
+    // Wait for any game using the package, rather than making it fail to
+    // get its own lock on it.
+    file_lock lock(filename + ".lock", "a");
+    package store(filename.c_str(), false);
+    for (const string &place : store.list_chunks())
+    {
+        try
+        {
+            bones_entries entries;
+            const save_version version =
+                _parse_bones_entries(store, place, entries);
+            if (version.is_future())
+            {
+                fprintf(stderr, "Skipping %s, from bones version %d.%d.\n",
+                        place.c_str(), version.major, version.minor);
+                continue;
+            }
+
+            vector<ghost_demon> &ghosts = places[place];
+            for (const auto &entry : entries)
+            {
+                reader inf(entry, version.minor);
+                inf.set_safe_read(true);
+                const vector<ghost_demon> some = tag_read_ghosts(inf);
+                ghosts.insert(ghosts.end(), some.begin(), some.end());
+            }
+        }
+        catch (short_read_exception &E)
+        {
+            fprintf(stderr, "Skipping broken ghosts for %s.\n",
+                    place.c_str());
+        }
+    }
+    return places;
+}
+
+static void _write_bones_entries(package &store, const string &place,
+                                 const bones_entries &entries)
+{
+    if (entries.empty())
+    {
+        store.delete_chunk(place);
+        return;
+    }
+
+    writer outw(&store, place);
+    write_ghost_version(outw);
+    marshallShort(outw, entries.size());
+    for (const auto &entry : entries)
+    {
+        marshallInt(outw, entry.size());
+        outw.write(&entry[0], entry.size());
+    }
 }
 
 static string _old_bones_filename(string ghost_filename, const save_version &v)
@@ -2469,20 +3580,39 @@ static vector<ghost_demon> _load_ephemeral_ghosts()
 {
     vector<ghost_demon> results;
 
-    string ghost_filename = _find_ghost_file();
-    if (ghost_filename.empty())
+    bones_store bones;
+    if (!bones.store)
+        return results;
+
+    const string place = _bones_place();
+    bones_entries entries;
+    if (!_read_bones_entries(*bones.store, place, entries) || entries.empty())
     {
-        _ghost_dprf("%s", "No ephemeral ghost files for this level.");
+        _ghost_dprf("%s", "No ephemeral ghosts for this level.");
         return results; // no such ghost.
     }
 
-    results = _load_ghosts_core(ghost_filename, true);
-
-    if (unlink(ghost_filename.c_str()) != 0)
+    // Whatever happens to them, these ghosts leave the store.
+    const int taken = random2(entries.size());
+    try
+    {
+        reader inf(entries[taken], save_version::current_bones().minor);
+        inf.set_safe_read(true);
+        results = tag_read_ghosts(inf);
+        if (!debug_check_ghosts(results))
+        {
+            mprf(MSGCH_ERROR, "Dropping buggy ghosts for %s.", place.c_str());
+            results.clear();
+        }
+    }
+    catch (short_read_exception &E)
     {
-        mprf(MSGCH_ERROR, "Failed to unlink bones file: %s",
-                ghost_filename.c_str());
+        mprf(MSGCH_ERROR, "Dropping broken ghosts for %s.", place.c_str());
+        results.clear();
     }
+
+    entries.erase(entries.begin() + taken);
+    _write_bones_entries(*bones.store, place, entries);
     return results;
 }
 
@@ -2642,6 +3772,7 @@ static bool _restore_game(const string& filename)
     clear_message_store();
 
     you.save = new package((_get_savefile_directory() + filename).c_str(), true);
+    set_save_compression(*you.save);
 
     if (!_read_char_chunk(you.save))
     {
@@ -2803,7 +3934,7 @@ static void _load_level(const level_id &level)
 // is generated.
 bool is_existing_level(const level_id &level)
 {
-    return you.save && you.save->has_chunk(level.describe());
+    return you.save && _level_chunk_exists(level.describe());
 }
 
 void delete_level(const level_id &level)
@@ -2816,7 +3947,12 @@ void delete_level(const level_id &level)
     clear_level_annotations(level);
 
     if (you.save)
-        you.save->delete_chunk(level.describe());
+    {
+        if (pregen_pipeline)
+            pregen_pipeline->flush();
+        for (int i = 0; i < NUM_LEVEL_SECTIONS; ++i)
+            you.save->delete_chunk(_level_section_chunk(level.describe(), i));
+    }
 
     auto &visited = you.props[VISITED_LEVELS_KEY].get_table();
     visited.erase(level.describe());
@@ -3039,6 +4175,9 @@ static bool _tagged_chunk_version_compatible(reader &inf, string* reason)
 static bool _restore_tagged_chunk(package *save, const string &name,
                                   tag_type tag, const char* complaint)
 {
+    if (pregen_pipeline && save == you.save)
+        pregen_pipeline->flush();
+
     reader inf(save, name);
     string reason;
     if (!_tagged_chunk_version_compatible(inf, &reason))
@@ -3055,7 +4194,16 @@ static bool _restore_tagged_chunk(package *save, const string &name,
     crawl_state.minor_version = inf.getMinorVersion();
     try
     {
-        tag_read(inf, tag);
+        if (tag == TAG_LEVEL
+#if TAG_MAJOR_VERSION == 34
+            && inf.getMinorVersion() >= TAG_MINOR_LEVEL_SECTIONS
+#endif
+           )
+        {
+            _read_level_sections(save, name, inf);
+        }
+        else
+            tag_read(inf, tag);
     }
     catch (short_read_exception &E)
     {
@@ -3080,39 +4228,6 @@ static bool _ghost_version_compatible(const save_version &version)
     return true;
 }
 
-/**
- * Attempt to open a new bones file for saving ghosts.
- *
- * @param[out] return_gfilename     The name of the file created, if any.
- * @return                          A FILE object, or nullptr.
- **/
-static FILE* _make_bones_file(string * return_gfilename)
-{
-    const string bone_dir = _get_bonefile_directory();
-    const string base_filename = _make_ghost_filename(false);
-
-    for (int i = 0; i < GHOST_LIMIT; i++)
-    {
-        const string g_file_name = make_stringf("%s%s_%d", bone_dir.c_str(),
-                                                base_filename.c_str(), i);
-        FILE *ghost_file = lk_open_exclusive(g_file_name);
-        // need to check file size, so can't open 'wb' - would truncate!
-
-        if (!ghost_file)
-        {
-            dprf("Could not open %s", g_file_name.c_str());
-            continue;
-        }
-
-        dprf("found %s", g_file_name.c_str());
-
-        *return_gfilename = g_file_name;
-        return ghost_file;
-    }
-
-    return nullptr;
-}
-
 #define GHOST_PERMASTORE_SIZE 10
 #define GHOST_PERMASTORE_REPLACE_CHANCE 5
 
@@ -3244,29 +4359,33 @@ void save_ghosts(const vector<ghost_demon> &ghosts, bool force, bool use_store)
     if (leftovers.size() == 0)
         return;
 
-    if (_list_bones().size() >= static_cast<size_t>(GHOST_LIMIT))
+    bones_store bones;
+    if (!bones.store)
     {
-        _ghost_dprf("Too many ghosts for this level already!");
+        _ghost_dprf("Could not open the bones package to save ghosts.");
         return;
     }
 
-    string g_file_name = "";
-    FILE* ghost_file = _make_bones_file(&g_file_name);
-
-    if (!ghost_file)
+    const string place = _bones_place();
+    bones_entries entries;
+    if (!_read_bones_entries(*bones.store, place, entries))
     {
-        _ghost_dprf("Could not open file to save ghosts.");
+        _ghost_dprf("Ghosts for this level are from a newer version.");
         return;
     }
 
-    writer outw(g_file_name, ghost_file);
+    if (entries.size() >= static_cast<size_t>(GHOST_LIMIT))
+    {
+        _ghost_dprf("Too many ghosts for this level already!");
+        return;
+    }
 
-    write_ghost_version(outw);
+    entries.emplace_back();
+    writer outw(&entries.back());
     tag_write_ghosts(outw, leftovers);
+    _write_bones_entries(*bones.store, place, entries);
 
-    lk_close(ghost_file);
-
-    _ghost_dprf("Saved ghosts (%s).", g_file_name.c_str());
+    _ghost_dprf("Saved ghosts (%s).", place.c_str());
 }
 
 ////////////////////////////////////////////////////////////////////////////
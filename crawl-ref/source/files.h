@@ -85,6 +85,7 @@ void update_portal_entrances();
 void reset_portal_entrances();
 bool generate_level(const level_id &l);
 bool pregen_dungeon(const level_id &stopping_point);
+void speculative_pregen();
 bool load_level(dungeon_feature_type stair_taken, load_mode_type load_mode,
                 const level_id& old_level);
 void delete_level(const level_id &level);
@@ -97,6 +98,7 @@ void save_game_state();
 save_version get_save_version(reader &file);
 
 bool save_exists(const string& filename);
+void set_save_compression(package &save);
 bool restore_game(const string& filename);
 
 bool is_existing_level(const level_id &level);
@@ -120,6 +122,9 @@ void save_ghosts(const vector<ghost_demon> &ghosts, bool force = false,
 bool load_ghosts(int max_ghosts, bool creating_level);
 bool define_ghost_from_bones(monster& mons);
 vector<ghost_demon> load_bones_file(string ghost_filename, bool backup=false);
+// Where ephemeral ghosts are kept, in the bones directory.
+#define BONES_STORE_FILE "bones.package"
+map<string, vector<ghost_demon>> load_bones_store(const string &filename);
 void write_ghost_version(writer &outf);
 save_version read_ghost_header(reader &inf);
 
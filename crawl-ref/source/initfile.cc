@@ -142,6 +142,7 @@ const vector<GameOption*> game_options::build_options_list()
     #define SIMPLE_NAME(_opt) _opt, {#_opt}
     vector<GameOption*> options = {
         new BoolGameOption(SIMPLE_NAME(autopickup_starting_ammo), true),
+        new BoolGameOption(SIMPLE_NAME(speculative_pregen), false),
         new BoolGameOption(SIMPLE_NAME(easy_door), true),
         new BoolGameOption(SIMPLE_NAME(default_show_all_skills), false),
         new BoolGameOption(SIMPLE_NAME(read_persist_options), false),
@@ -253,6 +254,9 @@ const vector<GameOption*> game_options::build_options_list()
         new IntGameOption(SIMPLE_NAME(hp_warning), 30, 0, 100),
         new IntGameOption(magic_point_warning, {"mp_warning"}, 0, 0, 100),
         new IntGameOption(SIMPLE_NAME(autofight_warning), 0, 0, 1000),
+        new IntGameOption(SIMPLE_NAME(los_cache_size), 1024, 0, 65536),
+        new StringGameOption(SIMPLE_NAME(save_compression), "zlib"),
+        new IntGameOption(SIMPLE_NAME(save_compression_level), 0, 0, 22),
         // These need to be odd, hence allow +1.
         new IntGameOption(SIMPLE_NAME(view_max_width),
                       max(VIEW_BASE_WIDTH, VIEW_MIN_WIDTH),
@@ -4032,7 +4036,7 @@ static edit_command<es_command_type> es_commands[] =
     { ES_GET,     "get",     false, 1, 2, },
     { ES_PUT,     "put",     true,  1, 2, },
     { ES_RM,      "rm",      true,  1, 1, },
-    { ES_REPACK,  "repack",  false, 0, 0, },
+    { ES_REPACK,  "repack",  false, 0, 2, },
     { ES_INFO,    "info",    false, 0, 0, },
 };
 
@@ -4055,7 +4059,9 @@ static void _edit_save(int argc, char **argv)
                "  put <chunk> [<chunkfile>]   import a chunk from <chunkfile>\n"
                "     <chunkfile> defaults to \"chunk\"; use \"-\" for stdout/stdin\n"
                "  rm <chunk>                  delete a chunk\n"
-               "  repack                      defrag and reclaim unused space\n"
+               "  repack [<codec> [<level>]]  defrag and reclaim unused space,\n"
+               "                              optionally recompressing with\n"
+               "                              <codec> (zlib, zstd or lz4)\n"
              );
         return;
     }
@@ -4159,6 +4165,28 @@ static void _edit_save(int argc, char **argv)
         else if (cmd == ES_REPACK)
         {
             package save2((filename + ".tmp").c_str(), true, true);
+            save_codec codec = save.get_codec();
+            int level = 0;
+            if (argc > 2)
+            {
+                codec = save_codec_by_name(argv[2]);
+                if (codec == NUM_SAVE_CODECS)
+                    FAIL("Unknown codec \"%s\".\n", argv[2]);
+                if (!save_codec_available(codec))
+                    FAIL("This build doesn't support %s.\n", argv[2]);
+            }
+            if (argc > 3)
+                level = atoi(argv[3]);
+            if (level < 0 || level > save_codec_max_level(codec))
+            {
+                fprintf(stderr, "Level %d is out of range for %s (0-%d), "
+                                "using its default.\n",
+                        level, save_codec_name(codec),
+                        save_codec_max_level(codec));
+                level = 0;
+            }
+            save2.set_codec(codec, level);
+
             for (const string &chunk : save.list_chunks())
             {
                 char buf[16384];
@@ -4200,6 +4228,7 @@ static void _edit_save(int argc, char **argv)
                    ((float)frag) / (nchunks + 1));
             printf("Unused space:     %u/%u (%u%%)\n", slack, flen,
                    100 - (100 * (flen - slack) / flen));
+            printf("Compression:      %s\n", save_codec_name(save.get_codec()));
             // there's also wasted space due to fragmentation, but since
             // it's linear, there's no need to print it
         }
@@ -4243,19 +4272,13 @@ static void _write_bones(const string &filename, vector<ghost_demon> ghosts)
     lk_close(ghost_file);
 }
 
-static void _bones_ls(const string &filename, const string name_match,
-                                                            bool long_output)
+// Returns how many of the ghosts matched.
+static int _list_ghosts(const vector<ghost_demon> &ghosts,
+                        const string &name_match, bool long_output)
 {
-    save_version v = _read_bones_version(filename);
-    cout << "Bones file '" << filename << "', version " << v.major << "."
-         << v.minor << ":\n";
-    const vector<ghost_demon> ghosts = load_bones_file(filename, false);
     monster m;
     if (long_output)
     {
-        init_monsters(); // no monster is valid without this
-        init_spell_descs();
-        init_spell_name_cache();
         m.reset();
         m.type = MONS_PROGRAM_BUG;
         m.base_monster = MONS_PHANTOM;
@@ -4291,6 +4314,43 @@ static void _bones_ls(const string &filename, const string name_match,
                  << "\n";
         }
     }
+    return count;
+}
+
+static bool _is_bones_store(const string &filename)
+{
+    return ends_with(filename, BONES_STORE_FILE);
+}
+
+static void _bones_ls(const string &filename, const string name_match,
+                                                            bool long_output)
+{
+    if (long_output)
+    {
+        init_monsters(); // no monster is valid without this
+        init_spell_descs();
+        init_spell_name_cache();
+    }
+
+    int count = 0;
+    if (_is_bones_store(filename))
+    {
+        cout << "Bones package '" << filename << "':\n";
+        for (const auto &place : load_bones_store(filename))
+        {
+            cout << place.first << ":\n";
+            count += _list_ghosts(place.second, name_match, long_output);
+        }
+    }
+    else
+    {
+        save_version v = _read_bones_version(filename);
+        cout << "Bones file '" << filename << "', version " << v.major << "."
+             << v.minor << ":\n";
+        count = _list_ghosts(load_bones_file(filename, false), name_match,
+                             long_output);
+    }
+
     if (!count)
     {
         if (name_match.size())
@@ -4366,7 +4426,8 @@ static void _edit_bones(int argc, char **argv)
     if (argc <= 1 || !strcmp(argv[1], "help"))
     {
         printf("Usage: crawl --bones <command> ARGS, where <command> may be:\n"
-               "  ls <file> [<name>] [--long] list the ghosts in <file>\n"
+               "  ls <file> [<name>] [--long] list the ghosts in <file>, which may be\n"
+               "                              the bones package\n"
                "                              --long shows full monster descriptions\n"
                "  merge <file1> <file2>       merge two bones files together, rewriting into <file2>\n"
                "  rm <file> <name>            rewrite a ghost file without <name>\n"
@@ -4397,6 +4458,9 @@ static void _edit_bones(int argc, char **argv)
         if (!file_exists(name))
             FAIL("'%s' doesn't exist!\n", name);
 
+        if (cmd != EB_LS && _is_bones_store(name))
+            FAIL("Only ls works on the bones package.\n");
+
         if (cmd == EB_LS)
         {
             const bool long_out =
@@ -5,26 +5,39 @@
 
 #include "l-libs.h"
 
+#include <chrono>
+
 #include "act-iter.h"
+#include "areas.h"
 #include "branch.h"
 #include "chardump.h"
 #include "cluautil.h"
 #include "coordit.h"
 #include "dbg-util.h"
 #include "dungeon.h"
+#include "env.h"
+#include "errors.h"
 #include "files.h"
+#include "ghost.h"
 #include "god-wrath.h"
 #include "los.h"
+#include "losglobal.h"
 #include "message.h"
 #include "mon-act.h"
 #include "mon-death.h"
 #include "mon-poly.h"
 #include "ng-setup.h"
+#include "package.h"
+#include "pcg.h"
 #include "religion.h"
 #include "stairs.h"
 #include "state.h"
 #include "stringutil.h"
+#include "tags.h"
+#include "terrain.h"
+#include "tiles-build-specific.h"
 #include "tileview.h"
+#include "unwind.h"
 #include "view.h"
 #include "wiz-dgn.h"
 
@@ -119,6 +132,382 @@ LUAFN(debug_reveal_mimics)
 
 LUAWRAP(debug_los_changed, los_changed())
 
+// Usage: los_benchmark(<iterations>)
+// Computes LOS from every cell in range of the player with both the bitset
+// kernel used by losight() and the scalar reference, raising an error if
+// they ever disagree. Returns the time each took, in milliseconds.
+LUAFN(debug_los_benchmark)
+{
+    const int iterations = lua_isnumber(ls, 1) ? lua_tointeger(ls, 1) : 100;
+
+    typedef chrono::steady_clock clock;
+    clock::duration bitset_time = clock::duration::zero();
+    clock::duration scalar_time = clock::duration::zero();
+    los_grid bitset_los, scalar_los;
+    for (int i = 0; i < iterations; ++i)
+        for (radius_iterator ri(you.pos(), LOS_MAX_RANGE, C_SQUARE); ri; ++ri)
+        {
+            const clock::time_point start = clock::now();
+            losight(bitset_los, *ri);
+            const clock::time_point mid = clock::now();
+            losight_scalar(scalar_los, *ri);
+            scalar_time += clock::now() - mid;
+            bitset_time += mid - start;
+
+            for (int y = -LOS_MAX_RANGE; y <= LOS_MAX_RANGE; ++y)
+                for (int x = -LOS_MAX_RANGE; x <= LOS_MAX_RANGE; ++x)
+                {
+                    const coord_def p(x, y);
+                    if (bitset_los(p) != scalar_los(p))
+                    {
+                        return luaL_error(ls, "LOS kernels disagree about "
+                                          "(%d,%d) from (%d,%d)",
+                                          x, y, ri->x, ri->y);
+                    }
+                }
+        }
+
+    using chrono::duration_cast;
+    using chrono::milliseconds;
+    lua_pushnumber(ls, duration_cast<milliseconds>(bitset_time).count());
+    lua_pushnumber(ls, duration_cast<milliseconds>(scalar_time).count());
+    return 2;
+}
+
+// Usage: block, shadows, auto = los_invalidate_benchmark(<iterations>,
+//                                                      <radius>)
+// Every open cell within radius of the player looks at every other; then
+// the cell east of the player (a door opening) and then eight cells in a
+// line south-east of it (a digging bolt) are invalidated in turn, and the
+// lookups repeated. Terrain isn't actually changed. Returns the time spent
+// invalidating and looking up again with each way of invalidating, in
+// microseconds per changed cell.
+LUAFN(debug_los_invalidate_benchmark)
+{
+    const int iterations = lua_isnumber(ls, 1) ? lua_tointeger(ls, 1) : 100;
+    const int radius = lua_isnumber(ls, 2) ? lua_tointeger(ls, 2) : 0;
+
+    vector<coord_def> viewers;
+    for (radius_iterator ri(you.pos(), radius, C_SQUARE); ri; ++ri)
+        if (!cell_is_solid(*ri))
+            viewers.push_back(*ri);
+
+    vector<coord_def> changes = { you.pos() + coord_def(1, 0) };
+    for (int i = 1; i <= 8; ++i)
+        changes.push_back(you.pos() + coord_def(i, 1));
+
+    auto look = [&viewers]()
+    {
+        for (const coord_def &p : viewers)
+            for (const coord_def &q : viewers)
+                cell_see_cell(p, q, LOS_DEFAULT);
+    };
+
+    typedef chrono::steady_clock clock;
+    const los_invalidation hows[] =
+    {
+        LOS_INVALIDATE_BLOCK, LOS_INVALIDATE_SHADOWS, LOS_INVALIDATE_AUTO
+    };
+    for (los_invalidation how : hows)
+    {
+        clock::duration time = clock::duration::zero();
+        for (int i = 0; i < iterations; ++i)
+        {
+            invalidate_los();
+            look();
+            for (const coord_def &p : changes)
+            {
+                const clock::time_point start = clock::now();
+                invalidate_los_around(p, how);
+                look();
+                time += clock::now() - start;
+            }
+        }
+        const double us =
+            chrono::duration_cast<chrono::microseconds>(time).count();
+        lua_pushnumber(ls, us / (iterations * changes.size()));
+    }
+    invalidate_los();
+    return 3;
+}
+
+// Usage: hits, misses, evictions, bytes = los_cache_stats()
+LUAFN(debug_los_cache_stats)
+{
+    const los_cache_stats stats = get_los_cache_stats();
+    lua_pushnumber(ls, stats.hits);
+    lua_pushnumber(ls, stats.misses);
+    lua_pushnumber(ls, stats.evictions);
+    lua_pushnumber(ls, stats.bytes);
+    return 4;
+}
+
+// The tags save_benchmark() and save_fuzz() know how to marshall, by the
+// name they go by in Lua. The player can't be read back without clobbering
+// the live one (and the branch tables and travel cache that go with it), so
+// it is only written.
+static const struct
+{
+    const char *name;
+    tag_type tag;
+    bool read_back;
+} bench_tags[] =
+{
+    { "you",   TAG_YOU,   false },
+    { "level", TAG_LEVEL, true },
+    { "ghost", TAG_GHOST, true },
+};
+
+// A few ghosts of the current player, as would go into a bones file.
+static vector<ghost_demon> _bench_ghosts()
+{
+    ghost_demon ghost;
+    ghost.init_player_ghost();
+    return vector<ghost_demon>(3, ghost);
+}
+
+static void _bench_write(tag_type tag, vector<unsigned char> &data)
+{
+    data.clear();
+    writer outf(&data);
+    if (tag == TAG_GHOST)
+        tag_write_ghosts(outf, _bench_ghosts());
+    else
+        tag_write(tag, outf);
+}
+
+// Reads a marshalled level or ghosts back. The level goes into `scratch`,
+// which should be fresh, so that neither the current level nor a torn read
+// is left behind; ghosts are read into a new vector each time.
+static void _bench_read(tag_type tag, const vector<unsigned char> &data,
+                        bool safe, crawl_environment &scratch)
+{
+    ASSERT(tag != TAG_YOU);
+    reader inf(data, TAG_MINOR_VERSION);
+    inf.set_safe_read(safe);
+    if (tag == TAG_GHOST)
+        tag_read_ghosts(inf);
+    else
+    {
+        env_activator reading(scratch);
+        tag_read(inf, tag);
+    }
+}
+
+// Usage: save_benchmark(<iterations>)
+// Marshalls the player, the current level and a few ghosts of the player as
+// a save would, <iterations> times over, and reads the level and ghosts
+// back as often. Returns a table keyed by tag name ("you", "level",
+// "ghost"), each entry giving the size in "bytes", the milliseconds spent in
+// "write_ms", the compressed size and milliseconds for every available
+// codec (as e.g. "zlib" and "zlib_ms"), and for the level and ghosts the
+// milliseconds spent in "read_ms" and whether writing what was read gave
+// the same bytes ("roundtrip").
+LUAFN(debug_save_benchmark)
+{
+    const int iterations = lua_isnumber(ls, 1) ? lua_tointeger(ls, 1) : 10;
+    unwind_var<int> minor(crawl_state.minor_version, TAG_MINOR_VERSION);
+
+    typedef chrono::steady_clock clock;
+    typedef chrono::duration<double, milli> ms;
+
+    lua_newtable(ls);
+    for (const auto &bt : bench_tags)
+    {
+        vector<unsigned char> data;
+        clock::duration write_time = clock::duration::zero();
+        for (int i = 0; i < iterations; ++i)
+        {
+            const clock::time_point start = clock::now();
+            _bench_write(bt.tag, data);
+            write_time += clock::now() - start;
+        }
+
+        lua_newtable(ls);
+        lua_pushnumber(ls, data.size());
+        lua_setfield(ls, -2, "bytes");
+        lua_pushnumber(ls, ms(write_time).count());
+        lua_setfield(ls, -2, "write_ms");
+
+        if (bt.read_back)
+        {
+            unique_ptr<crawl_environment> scratch;
+            clock::duration read_time = clock::duration::zero();
+            for (int i = 0; i < iterations; ++i)
+            {
+                scratch.reset(new crawl_environment);
+                const clock::time_point start = clock::now();
+                _bench_read(bt.tag, data, false, *scratch);
+                read_time += clock::now() - start;
+            }
+
+            vector<unsigned char> again;
+            {
+                env_activator writing(*scratch);
+                _bench_write(bt.tag, again);
+            }
+            lua_pushnumber(ls, ms(read_time).count());
+            lua_setfield(ls, -2, "read_ms");
+            lua_pushboolean(ls, again == data);
+            lua_setfield(ls, -2, "roundtrip");
+        }
+
+        for (int c = 0; c < NUM_SAVE_CODECS; ++c)
+        {
+            const save_codec codec = static_cast<save_codec>(c);
+            if (!save_codec_available(codec))
+                continue;
+            vector<unsigned char> zdata;
+            clock::duration zip_time = clock::duration::zero();
+            for (int i = 0; i < iterations; ++i)
+            {
+                const clock::time_point start = clock::now();
+                compress_chunk_data(data, zdata, codec);
+                zip_time += clock::now() - start;
+            }
+            const string name = save_codec_name(codec);
+            lua_pushnumber(ls, zdata.size());
+            lua_setfield(ls, -2, name.c_str());
+            lua_pushnumber(ls, ms(zip_time).count());
+            lua_setfield(ls, -2, (name + "_ms").c_str());
+        }
+
+        lua_setfield(ls, -2, bt.name);
+    }
+
+    // Reading a level can fill the LOS and area caches from it.
+    invalidate_los();
+    invalidate_agrid(true);
+    return 1;
+}
+
+// Damages a marshalled tag in a few random ways. The length in front is
+// never made larger, so that the reader isn't asked to allocate gigabytes,
+// but is sometimes cut down to match a shortened tag so that the tag's own
+// reader, not just the outer one, runs out of data. Only ghosts, which are
+// read from untrusted bones, get their contents changed: the level reader
+// rightly dies on a missing canary, so it is only cut short.
+static void _damage_tag(vector<unsigned char> &data, bool contents,
+                        rng::PcgRNG &rng)
+{
+    const size_t header = sizeof(int32_t);
+    const int damage = 1 + rng(4);
+    for (int i = 0; i < damage && data.size() > header; ++i)
+    {
+        const uint32_t body = data.size() - header;
+        switch (contents ? rng(4) : 0)
+        {
+        case 0: // cut short
+            data.resize(header + rng(body));
+            if (rng(2))
+            {
+                vector<unsigned char> len;
+                writer outf(&len);
+                marshallInt(outf, data.size() - header);
+                copy(len.begin(), len.end(), data.begin());
+            }
+            break;
+        case 1: // flip a bit
+            data[header + rng(body)] ^= 1 << rng(8);
+            break;
+        case 2: // clobber a byte
+            data[header + rng(body)] = rng(2) ? 0xff : 0;
+            break;
+        default: // repeat a span
+        {
+            const uint32_t start = rng(body);
+            const uint32_t len = 1 + rng(min<uint32_t>(body - start, 16));
+            const vector<unsigned char> span(
+                data.begin() + header + start,
+                data.begin() + header + start + len);
+            data.insert(data.begin() + header + start, span.begin(),
+                        span.end());
+            break;
+        }
+        }
+    }
+}
+
+// Usage: ok, short, failed = save_fuzz(<tag>, <iterations>, <seed>)
+// Reads back <iterations> damaged copies of a marshalled tag ("level" or
+// "ghost") with safe reads, counting those that read through, those that
+// ran out of data and those rejected as corrupt. The same seed gives the
+// same damage. Each level is read into a fresh scratch environment, so the
+// current level is left alone.
+LUAFN(debug_save_fuzz)
+{
+    const string name = luaL_checkstring(ls, 1);
+    const int iterations = lua_isnumber(ls, 2) ? lua_tointeger(ls, 2) : 100;
+    const uint64_t seed = lua_isnumber(ls, 3) ? lua_tointeger(ls, 3) : 0;
+
+    tag_type tag = NUM_TAGS;
+    for (const auto &bt : bench_tags)
+        if (name == bt.name && bt.read_back)
+            tag = bt.tag;
+    if (tag == NUM_TAGS)
+        return luaL_argerror(ls, 1, ("can't read back " + name).c_str());
+
+    unwind_var<int> minor(crawl_state.minor_version, TAG_MINOR_VERSION);
+
+    vector<unsigned char> clean;
+    _bench_write(tag, clean);
+
+    int ok = 0, short_reads = 0, failed = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        rng::PcgRNG rng(seed, i);
+        vector<unsigned char> data = clean;
+        _damage_tag(data, tag == TAG_GHOST, rng);
+        unique_ptr<crawl_environment> scratch(new crawl_environment);
+        try
+        {
+            _bench_read(tag, data, true, *scratch);
+            ++ok;
+        }
+        catch (short_read_exception &)
+        {
+            ++short_reads;
+        }
+        catch (ext_fail_exception &)
+        {
+            ++failed;
+        }
+    }
+
+    invalidate_los();
+    invalidate_agrid(true);
+
+    lua_pushnumber(ls, ok);
+    lua_pushnumber(ls, short_reads);
+    lua_pushnumber(ls, failed);
+    return 3;
+}
+
+#ifdef USE_TILE_WEB
+// Usage: ms, bytes = webtiles_benchmark(<iterations>, <map level>)
+// Builds everything a newly joined webtiles spectator is sent, <iterations>
+// times over, without sending it. If <map level> is true, the whole level is
+// magic mapped first. Returns the time that took, in milliseconds, and the
+// bytes built.
+LUAFN(debug_webtiles_benchmark)
+{
+    const int iterations = lua_isnumber(ls, 1) ? lua_tointeger(ls, 1) : 10;
+    if (lua_toboolean(ls, 2))
+    {
+        magic_mapping(1000, 100, true, true, true);
+        viewwindow();
+    }
+
+    double ms;
+    size_t bytes;
+    tiles.benchmark_send_everything(iterations, ms, bytes);
+
+    lua_pushnumber(ls, ms);
+    lua_pushnumber(ls, bytes);
+    return 2;
+}
+#endif
+
 LUAFN(debug_dump_map)
 {
     const int pos = lua_isuserdata(ls, 1) ? 2 : 1;
@@ -444,6 +833,14 @@ const struct luaL_reg debug_dlib[] =
 { "generate_level", debug_generate_level },
 { "reveal_mimics", debug_reveal_mimics },
 { "los_changed", debug_los_changed },
+{ "los_benchmark", debug_los_benchmark },
+{ "los_invalidate_benchmark", debug_los_invalidate_benchmark },
+{ "los_cache_stats", debug_los_cache_stats },
+{ "save_benchmark", debug_save_benchmark },
+{ "save_fuzz", debug_save_fuzz },
+#ifdef USE_TILE_WEB
+{ "webtiles_benchmark", debug_webtiles_benchmark },
+#endif
 { "dump_map", debug_dump_map },
 { "vault_names", debug_vault_names },
 { "test_explore", _debug_test_explore },
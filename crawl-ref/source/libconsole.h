@@ -24,6 +24,7 @@ void putwch(char32_t c);
 void set_getch_returns_resizes(bool rr);
 int getch_ck();
 bool kbhit();
+bool kbhit_within(unsigned int ms);
 void delay(unsigned int ms);
 void puttext(int x, int y, const crawl_view_buffer &vbuf);
 void update_screen();
@@ -188,6 +188,19 @@ bool kbhit()
     return wm->next_event_is(WME_KEYDOWN);
 }
 
+bool kbhit_within(unsigned int ms)
+{
+    // The window manager can only wait for an event by taking it, so look
+    // now and then instead.
+    for (unsigned int waited = 0; !kbhit(); waited += 10)
+    {
+        if (waited >= ms)
+            return false;
+        wm->delay(10);
+    }
+    return true;
+}
+
 void console_startup()
 {
     tiles.resize();
@@ -1578,3 +1578,43 @@ bool kbhit()
     return result;
 #endif
 }
+
+/**
+ * Wait for up to `ms` milliseconds for a key press. Webtiles output keeps
+ * going out meanwhile.
+ *
+ * @return whether a key is waiting to be read.
+ */
+bool kbhit_within(unsigned int ms)
+{
+    if (pending)
+        return true;
+
+    wint_t c;
+#ifndef USE_TILE_WEB
+    timeout(ms);
+    const int i = get_wch(&c);
+    timeout(-1);
+
+    switch (i)
+    {
+    case OK:
+        pending = c;
+        return true;
+    case KEY_CODE_YES:
+        pending = -c;
+        return true;
+    default:
+        return false;
+    }
+#else
+    refresh();
+    tiles.redraw();
+    bool result = tiles.await_input(c, true, ms);
+
+    if (result && c != 0)
+        pending = c;
+
+    return result;
+#endif
+}
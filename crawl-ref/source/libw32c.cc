@@ -914,6 +914,16 @@ bool kbhit()
     return 0;
 }
 
+// Any console event ends the wait, so a mouse movement counts as the player
+// not being idle.
+bool kbhit_within(unsigned int ms)
+{
+    if (kbhit())
+        return true;
+    WaitForSingleObject(inbuf, ms);
+    return kbhit();
+}
+
 void delay(unsigned int ms)
 {
     if (crawl_state.disables[DIS_DELAY])
@@ -46,6 +46,12 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #include "areas.h"
 #include "coord.h"
@@ -78,6 +84,13 @@ static vector<coord_def> cellray_ends;
 typedef FixedArray<bit_vector*, LOS_MAX_RANGE+1, LOS_MAX_RANGE+1> blockrays_t;
 static blockrays_t blockrays;
 
+// The reverse view of blockrays: for each cell p, the distinct end cells
+// of the cellrays that p can block. Only the visibility of these cells can
+// depend on the opacity of p.
+typedef FixedArray<vector<coord_def>, LOS_MAX_RANGE+1, LOS_MAX_RANGE+1>
+    shadows_t;
+static shadows_t shadows;
+
 // We also store the minimal cellrays by target position
 // for efficient retrieval by find_ray.
 // XXX: Consider condensing this representation.
@@ -90,6 +103,15 @@ static FixedArray<vector<cellray>, LOS_MAX_RANGE+1, LOS_MAX_RANGE+1> min_cellray
 static bit_vector *dead_rays     = nullptr;
 static bit_vector *smoke_rays    = nullptr;
 
+// The same blocking information as blockrays, but laid out for the bitset
+// kernel: one run of ray_words 64-bit words per quadrant cell, padded to a
+// whole number of 256-bit lanes so it can be combined without a tail loop.
+#define RAY_LANE_WORDS 4
+static int ray_words = 0;
+static vector<uint64_t> blockray_words;
+static vector<uint64_t> dead_words;
+static vector<uint64_t> smoke_words;
+
 class quadrant_iterator : public rectangle_iterator
 {
 public:
@@ -382,6 +404,11 @@ static void _register_ray(geom::ray r)
     fullrays.push_back(ray);
 }
 
+static int _quadrant_index(const coord_def& p)
+{
+    return p.y * (LOS_MAX_RANGE + 1) + p.x;
+}
+
 static void _create_blockrays()
 {
     // First, we calculate blocking information for all cell rays.
@@ -428,9 +455,34 @@ static void _create_blockrays()
     for (quadrant_iterator qi; qi; ++qi)
         delete all_blockrays(*qi);
 
+    for (quadrant_iterator qi; qi; ++qi)
+    {
+        vector<coord_def> &shadow = shadows(*qi);
+        for (int i = 0; i < n_min_rays; ++i)
+            if (blockrays(*qi)->get(i))
+                shadow.push_back(cellray_ends[i]);
+        sort(shadow.begin(), shadow.end());
+        shadow.erase(unique(shadow.begin(), shadow.end()), shadow.end());
+    }
+
     dead_rays  = new bit_vector(n_min_rays);
     smoke_rays = new bit_vector(n_min_rays);
 
+    ray_words = (n_min_rays + 63) / 64;
+    ray_words = (ray_words + RAY_LANE_WORDS - 1)
+                / RAY_LANE_WORDS * RAY_LANE_WORDS;
+    blockray_words.assign((LOS_MAX_RANGE + 1) * (LOS_MAX_RANGE + 1)
+                          * ray_words, 0);
+    for (quadrant_iterator qi; qi; ++qi)
+    {
+        uint64_t *words = &blockray_words[_quadrant_index(*qi) * ray_words];
+        for (int i = 0; i < n_min_rays; ++i)
+            if (blockrays(*qi)->get(i))
+                words[i / 64] |= uint64_t(1) << (i % 64);
+    }
+    dead_words.resize(ray_words);
+    smoke_words.resize(ray_words);
+
     dprf("Cellrays: %d Fullrays: %u Minimal cellrays: %u",
           n_cellrays, (unsigned int)fullrays.size(), n_min_rays);
 }
@@ -506,6 +558,25 @@ static void raycast()
     _create_blockrays();
 }
 
+/**
+ * Which cells' visibility can depend on the opacity of a given cell?
+ *
+ * @param p  The position of the blocking cell relative to the viewer, in the
+ *           positive quadrant (0 <= p.x, p.y <= LOS_MAX_RANGE).
+ * @return   The positions, relative to the viewer and in the same quadrant,
+ *           of the cells that can be hidden by p.
+ */
+const vector<coord_def>& los_cells_shadowed_by(const coord_def& p)
+{
+    ASSERT(p.x >= 0 && p.y >= 0);
+    ASSERT(p.rdist() <= LOS_MAX_RANGE);
+
+    // Ensure the precalculations have been done.
+    raycast();
+
+    return shadows(p);
+}
+
 static int _imbalance(ray_def ray, const coord_def& target)
 {
     int imb = 0;
@@ -836,6 +907,135 @@ static void _losight_quadrant(los_grid& sh, const los_param& dat, int sx, int sy
     }
 }
 
+// dead |= block
+static inline void _block_words(uint64_t *dead, const uint64_t *block, int n)
+{
+#if defined(__AVX2__)
+    for (int w = 0; w < n; w += 4)
+    {
+        __m256i *d = reinterpret_cast<__m256i*>(dead + w);
+        const __m256i b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + w));
+        _mm256_storeu_si256(d, _mm256_or_si256(_mm256_loadu_si256(d), b));
+    }
+#elif defined(__SSE2__)
+    for (int w = 0; w < n; w += 2)
+    {
+        __m128i *d = reinterpret_cast<__m128i*>(dead + w);
+        const __m128i b =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + w));
+        _mm_storeu_si128(d, _mm_or_si128(_mm_loadu_si128(d), b));
+    }
+#else
+    for (int w = 0; w < n; ++w)
+        dead[w] |= block[w];
+#endif
+}
+
+// dead |= smoke & block; smoke |= block
+static inline void _smoke_words(uint64_t *dead, uint64_t *smoke,
+                                const uint64_t *block, int n)
+{
+#if defined(__AVX2__)
+    for (int w = 0; w < n; w += 4)
+    {
+        __m256i *d = reinterpret_cast<__m256i*>(dead + w);
+        __m256i *s = reinterpret_cast<__m256i*>(smoke + w);
+        const __m256i b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + w));
+        const __m256i sv = _mm256_loadu_si256(s);
+        _mm256_storeu_si256(d, _mm256_or_si256(_mm256_loadu_si256(d),
+                                               _mm256_and_si256(sv, b)));
+        _mm256_storeu_si256(s, _mm256_or_si256(sv, b));
+    }
+#elif defined(__SSE2__)
+    for (int w = 0; w < n; w += 2)
+    {
+        __m128i *d = reinterpret_cast<__m128i*>(dead + w);
+        __m128i *s = reinterpret_cast<__m128i*>(smoke + w);
+        const __m128i b =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + w));
+        const __m128i sv = _mm_loadu_si128(s);
+        _mm_storeu_si128(d, _mm_or_si128(_mm_loadu_si128(d),
+                                         _mm_and_si128(sv, b)));
+        _mm_storeu_si128(s, _mm_or_si128(sv, b));
+    }
+#else
+    for (int w = 0; w < n; ++w)
+    {
+        dead[w]  |= smoke[w] & block[w];
+        smoke[w] |= block[w];
+    }
+#endif
+}
+
+static inline int _lowest_bit(uint64_t word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    int b = 0;
+    while (!(word & 1))
+    {
+        word >>= 1;
+        ++b;
+    }
+    return b;
+#endif
+}
+
+// The same as _losight_quadrant, but combining whole words of blockrays
+// at a time, and only visiting the rays that survive.
+static void _losight_quadrant_bits(los_grid& sh, const los_param& dat,
+                                   int sx, int sy)
+{
+    const int num_cellrays = cellray_ends.size();
+    uint64_t *dead  = dead_words.data();
+    uint64_t *smoke = smoke_words.data();
+
+    fill(dead_words.begin(), dead_words.end(), 0);
+    fill(smoke_words.begin(), smoke_words.end(), 0);
+
+    for (quadrant_iterator qi; qi; ++qi)
+    {
+        coord_def p = coord_def(sx*(qi->x), sy*(qi->y));
+        if (!dat.los_bounds(p))
+            continue;
+
+        const uint64_t *block =
+            &blockray_words[_quadrant_index(*qi) * ray_words];
+        switch (dat.opacity(p))
+        {
+        case OPC_OPAQUE:
+            _block_words(dead, block, ray_words);
+            break;
+        case OPC_HALF:
+            _smoke_words(dead, smoke, block, ray_words);
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (int w = 0; w < ray_words; ++w)
+    {
+        uint64_t alive = ~dead[w];
+        while (alive)
+        {
+            const int rayidx = w * 64 + _lowest_bit(alive);
+            alive &= alive - 1;
+            // The padding rays are never blocked, but don't exist.
+            if (rayidx >= num_cellrays)
+                break;
+
+            const coord_def p = coord_def(sx * cellray_ends[rayidx].x,
+                                          sy * cellray_ends[rayidx].y);
+            if (dat.los_bounds(p))
+                sh(p) = true;
+        }
+    }
+}
+
 struct los_param_funcs : public los_param
 {
     coord_def center;
@@ -859,8 +1059,9 @@ struct los_param_funcs : public los_param
     }
 };
 
-void losight(los_grid& sh, const coord_def& center,
-             const opacity_func& opc, const circle_def& bounds)
+static void _losight(los_grid& sh, const coord_def& center,
+                     const opacity_func& opc, const circle_def& bounds,
+                     bool bitset)
 {
     const los_param& dat = los_param_funcs(center, opc, bounds);
 
@@ -872,13 +1073,32 @@ void losight(los_grid& sh, const coord_def& center,
     const int quadrant_x[4] = {  1, -1, -1,  1 };
     const int quadrant_y[4] = {  1,  1, -1, -1 };
     for (int q = 0; q < 4; ++q)
-        _losight_quadrant(sh, dat, quadrant_x[q], quadrant_y[q]);
+    {
+        if (bitset)
+            _losight_quadrant_bits(sh, dat, quadrant_x[q], quadrant_y[q]);
+        else
+            _losight_quadrant(sh, dat, quadrant_x[q], quadrant_y[q]);
+    }
 
     // Center is always visible.
     const coord_def o = coord_def(0,0);
     sh(o) = true;
 }
 
+void losight(los_grid& sh, const coord_def& center,
+             const opacity_func& opc, const circle_def& bounds)
+{
+    _losight(sh, center, opc, bounds, true);
+}
+
+// The original ray-by-ray calculation, kept as a reference for the
+// bitset kernel that losight() uses.
+void losight_scalar(los_grid& sh, const coord_def& center,
+                    const opacity_func& opc, const circle_def& bounds)
+{
+    _losight(sh, center, opc, bounds, false);
+}
+
 opacity_type mons_opacity(const monster* mon, los_type how)
 {
     // no regard for LOS_ARENA
@@ -38,6 +38,7 @@ int num_feats_between(const coord_def& source, const coord_def& target,
                       bool exclude_endpoints = true,
                       bool just_check = false);
 bool cell_see_cell_nocache(const coord_def& p1, const coord_def& p2);
+const vector<coord_def>& los_cells_shadowed_by(const coord_def& p);
 
 typedef SquareArray<bool, LOS_MAX_RANGE> los_grid;
 
@@ -45,6 +46,9 @@ void clear_rays_on_exit();
 void losight(los_grid& sh, const coord_def& center,
              const opacity_func &opc = opc_default,
              const circle_def &bds = BDS_DEFAULT);
+void losight_scalar(los_grid& sh, const coord_def& center,
+                    const opacity_func &opc = opc_default,
+                    const circle_def &bds = BDS_DEFAULT);
 
 void los_actor_moved(const actor* act, const coord_def& oldpos);
 void los_monster_died(const monster* mon);
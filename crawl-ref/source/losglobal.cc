@@ -5,7 +5,9 @@
 #include "coord.h"
 #include "coordit.h"
 #include "libutil.h"
+#include "los.h"
 #include "los-def.h"
+#include "options.h"
 
 #define LOS_KNOWN 4
 
@@ -13,11 +15,81 @@ typedef uint8_t losfield_t;
 typedef losfield_t halflos_t[LOS_MAX_RANGE+1][2*LOS_MAX_RANGE+1];
 static const int o_half_x = 0;
 static const int o_half_y = LOS_MAX_RANGE;
-typedef halflos_t globallos_t[GXM][GYM];
 
-static globallos_t globallos;
+// The cache is split into square tiles of origin cells, allocated the
+// first time one of their cells is looked at and dropped, least recently
+// used first, when Options.los_cache_size is exceeded.
+#define LOS_TILE_SIZE 8
+#define LOS_TILES_X ((GXM + LOS_TILE_SIZE - 1) / LOS_TILE_SIZE)
+#define LOS_TILES_Y ((GYM + LOS_TILE_SIZE - 1) / LOS_TILE_SIZE)
+// A single refill writes pairs stored at origins in a 9x17 block, which
+// spans at most 2x3 tiles. Never evicting below that guarantees that the
+// tiles a refill writes to are still there when it finishes.
+#define LOS_MIN_TILES 9
+// Walking the shadows of a changed cell costs about as much as refilling
+// three or four viewpoints, so with fewer than that nearby it's cheaper to
+// clear the whole block of pairs the way we always used to.
+#define LOS_SHADOW_MIN_VIEWPOINTS 4
 
-static losfield_t* _lookup_globallos(const coord_def& p, const coord_def& q)
+struct los_tile
+{
+    halflos_t cells[LOS_TILE_SIZE][LOS_TILE_SIZE];
+    uint64_t last_used;
+};
+
+static unique_ptr<los_tile> globallos[LOS_TILES_X][LOS_TILES_Y];
+static int los_tiles_used = 0;
+static uint64_t los_clock = 0;
+static los_cache_stats los_stats;
+// Origins that have been refilled from since they were last cleared.
+static FixedBitArray<GXM, GYM> los_viewpoints;
+
+static int _los_tile_budget()
+{
+    const int tiles = Options.los_cache_size * 1024 / sizeof(los_tile);
+    return max(tiles, LOS_MIN_TILES);
+}
+
+static void _evict_los_tile()
+{
+    unique_ptr<los_tile> *oldest = nullptr;
+    for (int x = 0; x < LOS_TILES_X; x++)
+        for (int y = 0; y < LOS_TILES_Y; y++)
+            if (globallos[x][y]
+                && (!oldest
+                    || globallos[x][y]->last_used < (*oldest)->last_used))
+            {
+                oldest = &globallos[x][y];
+            }
+
+    ASSERT(oldest);
+    oldest->reset();
+    los_tiles_used--;
+    los_stats.evictions++;
+}
+
+// Find the pairs stored at origin p. If alloc is false, don't create the
+// tile if it's missing, and don't count this as a use.
+static halflos_t* _globallos_at(const coord_def& p, bool alloc)
+{
+    unique_ptr<los_tile> &tile =
+        globallos[p.x / LOS_TILE_SIZE][p.y / LOS_TILE_SIZE];
+    if (!tile)
+    {
+        if (!alloc)
+            return nullptr;
+        while (los_tiles_used >= _los_tile_budget())
+            _evict_los_tile();
+        tile.reset(new los_tile());
+        los_tiles_used++;
+    }
+    if (alloc)
+        tile->last_used = ++los_clock;
+    return &tile->cells[p.x % LOS_TILE_SIZE][p.y % LOS_TILE_SIZE];
+}
+
+static losfield_t* _lookup_globallos(const coord_def& p, const coord_def& q,
+                                     bool alloc = true)
 {
     COMPILE_CHECK(LOS_KNOWN * 2 <= sizeof(losfield_t) * 8);
 
@@ -28,9 +100,17 @@ static losfield_t* _lookup_globallos(const coord_def& p, const coord_def& q)
         return nullptr;
     // p < q iff p.x < q.x || p.x == q.x && p.y < q.y
     if (diff < coord_def(0, 0))
-        return &globallos[q.x][q.y][-diff.x + o_half_x][-diff.y + o_half_y];
+    {
+        halflos_t *half = _globallos_at(q, alloc);
+        return half ? &(*half)[-diff.x + o_half_x][-diff.y + o_half_y]
+                    : nullptr;
+    }
     else
-        return &globallos[p.x][p.y][ diff.x + o_half_x][ diff.y + o_half_y];
+    {
+        halflos_t *half = _globallos_at(p, alloc);
+        return half ? &(*half)[ diff.x + o_half_x][ diff.y + o_half_y]
+                    : nullptr;
+    }
 }
 
 static void _save_los(los_def* los, los_type l)
@@ -58,8 +138,29 @@ static void _save_los(los_def* los, los_type l)
         }
 }
 
-// Opacity at p has changed.
-void invalidate_los_around(const coord_def& p)
+// Forget the cached visibility between o and every cell that p can hide
+// from o.
+static void _invalidate_shadow(const coord_def& o, const coord_def& p)
+{
+    const coord_def d = p - o;
+    const coord_def q(abs(d.x), abs(d.y));
+    // Cells on an axis belong to both adjoining quadrants.
+    const int sx_min = d.x > 0 ? 1 : -1, sx_max = d.x < 0 ? -1 : 1;
+    const int sy_min = d.y > 0 ? 1 : -1, sy_max = d.y < 0 ? -1 : 1;
+
+    for (const coord_def &t : los_cells_shadowed_by(q))
+        for (int sx = sx_min; sx <= sx_max; sx += 2)
+            for (int sy = sy_min; sy <= sy_max; sy += 2)
+                if (losfield_t* flags =
+                        _lookup_globallos(o, o + coord_def(sx*t.x, sy*t.y),
+                                          false))
+                {
+                    *flags = 0;
+                }
+}
+
+// Forget every pair that could have a cellray through p.
+static void _invalidate_block(const coord_def& p)
 {
     int x1 = max(p.x - LOS_MAX_RANGE, 0);
     int y1 = max(p.y - LOS_MAX_RANGE, 0);
@@ -67,17 +168,86 @@ void invalidate_los_around(const coord_def& p)
     int y2 = min(p.y + LOS_MAX_RANGE, GYM - 1);
     for (int y = y1; y <= y2; y++)
         for (int x = x1; x <= x2; x++)
-            memset(globallos[x][y], 0, sizeof(halflos_t));
+            if (halflos_t* half = _globallos_at(coord_def(x, y), false))
+                memset(half, 0, sizeof(halflos_t));
+}
+
+// Forget only the pairs with a cellray through p.
+static void _invalidate_shadows(const coord_def& p)
+{
+    int x1 = max(p.x - LOS_MAX_RANGE, 0);
+    int y1 = max(p.y - LOS_MAX_RANGE, 0);
+    int x2 = min(p.x + LOS_MAX_RANGE, GXM - 1);
+    int y2 = min(p.y + LOS_MAX_RANGE, GYM - 1);
+    // Visibility is cached once per pair but may have been computed from
+    // either end, so look from every cell that could have seen past p.
+    for (int y = y1; y <= y2; y++)
+        for (int x = x1; x <= x2; x++)
+            if (x != p.x || y != p.y)
+                _invalidate_shadow(coord_def(x, y), p);
+}
+
+// How many origins close enough to p to have pairs stored in its block
+// have been refilled from? Clears them if reset is set.
+static int _viewpoints_near(const coord_def& p, bool reset)
+{
+    int x1 = max(p.x - 2 * LOS_MAX_RANGE, 0);
+    int y1 = max(p.y - 2 * LOS_MAX_RANGE, 0);
+    int x2 = min(p.x + 2 * LOS_MAX_RANGE, GXM - 1);
+    int y2 = min(p.y + 2 * LOS_MAX_RANGE, GYM - 1);
+    int count = 0;
+    for (int y = y1; y <= y2; y++)
+        for (int x = x1; x <= x2; x++)
+            if (los_viewpoints(x, y))
+            {
+                count++;
+                if (reset)
+                    los_viewpoints.set(x, y, false);
+            }
+    return count;
+}
+
+// Opacity at p has changed. Only pairs of cells with a cellray through p
+// can be affected; unless there's little cached around p, keep the rest.
+void invalidate_los_around(const coord_def& p, los_invalidation how)
+{
+    if (!map_bounds(p))
+        return;
+
+    if (how == LOS_INVALIDATE_AUTO)
+    {
+        how = _viewpoints_near(p, false) < LOS_SHADOW_MIN_VIEWPOINTS
+              ? LOS_INVALIDATE_BLOCK : LOS_INVALIDATE_SHADOWS;
+    }
+
+    if (how == LOS_INVALIDATE_BLOCK)
+    {
+        _invalidate_block(p);
+        _viewpoints_near(p, true);
+    }
+    else
+        _invalidate_shadows(p);
 }
 
 void invalidate_los()
 {
-    for (rectangle_iterator ri(0); ri; ++ri)
-        memset(globallos[ri->x][ri->y], 0, sizeof(halflos_t));
+    for (int x = 0; x < LOS_TILES_X; x++)
+        for (int y = 0; y < LOS_TILES_Y; y++)
+            globallos[x][y].reset();
+    los_tiles_used = 0;
+    los_viewpoints.reset();
+}
+
+los_cache_stats get_los_cache_stats()
+{
+    los_cache_stats stats = los_stats;
+    stats.bytes = los_tiles_used * sizeof(los_tile);
+    return stats;
 }
 
 static void _update_globallos_at(const coord_def& p, los_type l)
 {
+    los_viewpoints.set(p);
     switch (l)
     {
     case LOS_DEFAULT:
@@ -113,6 +283,13 @@ static void _update_globallos_at(const coord_def& p, los_type l)
     }
 }
 
+/**
+ * Can q be seen from p?
+ *
+ * A miss refills every cell in range of p at once, so checking many cells
+ * from one viewpoint, as area effects do, walks the rays once and then only
+ * looks the rest up.
+ */
 bool cell_see_cell(const coord_def& p, const coord_def& q, los_type l)
 {
     if (l == LOS_NONE)
@@ -124,7 +301,12 @@ bool cell_see_cell(const coord_def& p, const coord_def& q, los_type l)
         return false; // outside range
 
     if (!(*flags & (l << LOS_KNOWN)))
+    {
+        los_stats.misses++;
         _update_globallos_at(p, l);
+    }
+    else
+        los_stats.hits++;
 
     ASSERT(*flags & (l << LOS_KNOWN));
     return *flags & l;
@@ -2,7 +2,24 @@
 
 #include "los-type.h"
 
-void invalidate_los_around(const coord_def& p);
+struct los_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t bytes;       // currently allocated
+};
+
+enum los_invalidation
+{
+    LOS_INVALIDATE_AUTO,    // pick whichever is likely to be cheaper
+    LOS_INVALIDATE_BLOCK,   // everything stored near p
+    LOS_INVALIDATE_SHADOWS, // only pairs with a cellray through p
+};
+
+void invalidate_los_around(const coord_def& p,
+                           los_invalidation how = LOS_INVALIDATE_AUTO);
 void invalidate_los();
+los_cache_stats get_los_cache_stats();
 
 bool cell_see_cell(const coord_def& p, const coord_def& q, los_type l);
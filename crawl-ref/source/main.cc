@@ -164,7 +164,12 @@ CLua dlua;
 CLua clua(true);
 CLua dlua(false);      // Lua interpreter for the dungeon builder.
 #endif
-crawl_environment env; // Requires dlua.
+#ifdef DEBUG_GLOBALS
+crawl_environment *real_env = nullptr;
+#else
+static crawl_environment main_env; // Requires dlua.
+crawl_environment *real_env = &main_env;
+#endif
 
 player you;
 
@@ -2337,6 +2342,11 @@ static keycode_type _get_next_keycode()
     flush_input_buffer(FLUSH_BEFORE_COMMAND);
 
     mouse_control mc(MOUSE_MODE_COMMAND);
+
+    // The screen is up to date: use the time the player spends deciding.
+    if (!has_pending_input())
+        speculative_pregen();
+
     for (;;)
     {
         keyin = unmangle_direction_keys(getch_with_command_macros());
@@ -2315,6 +2315,10 @@ static void _post_monster_move(monster* mons)
         monster_die(*mons, KILL_MISC, NON_MONSTER);
 }
 
+// Monsters waiting to act, highest energy first. Monsters with equal energy
+// act in whatever order the heap leaves them, and seeded games and replays
+// depend on that order, so this can't become a structure that breaks ties
+// any other way (queue order, monster index...).
 priority_queue<pair<monster *, int>,
                vector<pair<monster *, int> >,
                MonsterActionQueueCompare> monster_queue;
@@ -2450,6 +2454,7 @@ void handle_monsters(bool with_noise)
         }
     }
     _display_just_seen();
+    clear_shared_paths();
 
     // Process noises now (before clearing the sleep flag).
     if (with_noise)
@@ -89,6 +89,94 @@ bool target_is_unreachable(monster* mon)
            || mon->travel_target == MTRAV_KNOWN_UNREACHABLE;
 }
 
+// Searches towards popular targets this turn. When at least
+// MIN_SHARED_PATH_CHASERS monsters of the same kind are after the same
+// target, the first of them to need a path builds a distance field from the
+// target, and all of them just follow it.
+struct shared_path_field
+{
+    level_id place;
+    int turn;
+    coord_def target;
+    monster_type type;
+    mon_attitude_type attitude;
+    int range;
+    unique_ptr<monster_pathfind> field; // null if too few chasers
+};
+
+#define MAX_SHARED_PATH_FIELDS 8
+#define MIN_SHARED_PATH_CHASERS 3
+static vector<shared_path_field> shared_path_fields;
+
+// Drop the shared fields, at the end of the monsters' turn or on leaving a
+// level.
+void clear_shared_paths()
+{
+    shared_path_fields.clear();
+}
+
+// Where are the monsters that might need the same path as mon?
+static vector<coord_def> _fellow_chasers(const monster* mon,
+                                         const coord_def& targpos, int range)
+{
+    vector<coord_def> chasers;
+    for (monster_iterator mi; mi; ++mi)
+    {
+        if (mi->type == mon->type && mi->attitude == mon->attitude
+            && mi->foe == mon->foe
+            && (!range || grid_distance(mi->pos(), targpos) <= range))
+        {
+            chasers.push_back(mi->pos());
+        }
+    }
+    return chasers;
+}
+
+// Try to set up mp with mon's path to targpos from a shared field.
+static bool _shared_pathfind(const monster* mon, const coord_def& targpos,
+                             int range, monster_pathfind &mp)
+{
+    const level_id place = level_id::current();
+    const int turn = you.num_turns;
+    // Fields from an earlier turn or another level are stale.
+    erase_if(shared_path_fields, [&](const shared_path_field &f)
+             { return f.turn != turn || f.place != place; });
+
+    shared_path_field *shared = nullptr;
+    for (shared_path_field &f : shared_path_fields)
+    {
+        if (f.target == targpos && f.type == mon->type
+            && f.attitude == mon->attitude && f.range == range)
+        {
+            shared = &f;
+            break;
+        }
+    }
+
+    if (!shared)
+    {
+        if (shared_path_fields.size() >= MAX_SHARED_PATH_FIELDS)
+            return false;
+        shared_path_fields.push_back({ place, turn, targpos, mon->type,
+                                       mon->attitude, range, nullptr });
+        shared = &shared_path_fields.back();
+
+        // For one or two chasers, separate searches are cheaper than a
+        // field.
+        const vector<coord_def> chasers =
+            _fellow_chasers(mon, targpos, range);
+        if (chasers.size() >= MIN_SHARED_PATH_CHASERS)
+        {
+            shared->field.reset(new monster_pathfind());
+            if (range > 0)
+                shared->field->set_range(range);
+            shared->field->init_field(mon, targpos, chasers);
+        }
+    }
+
+    return shared->field && mp.init_from_field(mon, *shared->field);
+}
+
 //#define DEBUG_PATHFIND
 
 // Check whether there's an unobstructed path to our foe,
@@ -215,7 +303,8 @@ bool try_pathfind(monster* mon)
     if (range > 0)
         mp.set_range(range);
 
-    if (mp.init_pathfind(mon, targpos))
+    if (_shared_pathfind(mon, targpos, range, mp)
+        || mp.init_pathfind(mon, targpos))
     {
         mon->travel_path = mp.calc_waypoints();
         if (!mon->travel_path.empty())
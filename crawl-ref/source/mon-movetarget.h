@@ -4,6 +4,7 @@ struct level_exit;
 
 bool target_is_unreachable(monster* mon);
 bool try_pathfind(monster* mon);
+void clear_shared_paths();
 void check_wander_target(monster* mon, bool isPacified = false);
 int mons_find_nearest_level_exit(const monster* mon, vector<level_exit> &e,
                                  bool reset = false);
@@ -62,16 +62,106 @@ int mons_tracking_range(const monster* mon)
     return range;
 }
 
+struct pathfind_node
+{
+    // dist and prev are only meaningful if this matches the workspace's
+    // generation; anything else is an untouched cell.
+    unsigned int generation;
+    // The distance from start to this point.
+    int dist;
+    // Where we came from on a given shortest path.
+    int prev;
+};
+
+// Everything a search needs that scales with the map. Allocating and
+// clearing this for every search cost far more than most searches, so
+// workspaces are pooled, and a new search just bumps the generation
+// instead of resetting every node.
+struct pathfind_workspace
+{
+    pathfind_workspace() : generation(0), nodes(), hash(), hash_used(0) {}
+
+    void new_search()
+    {
+        if (++generation == 0)
+        {
+            // Wrapped around: stale stamps could look current again.
+            for (int i = 0; i < GXM; i++)
+                for (int j = 0; j < GYM; j++)
+                    nodes[i][j].generation = 0;
+            generation = 1;
+        }
+
+        // Only the buckets the last search pushed to can be dirty.
+        for (int i = 0; i <= hash_used; i++)
+            hash[i].clear();
+        hash_used = 0;
+    }
+
+    unsigned int generation;
+    pathfind_node nodes[GXM][GYM];
+    FixedVector<vector<coord_def>, GXM * GYM> hash;
+    int hash_used;
+};
+
+// Workspaces not currently lent to a monster_pathfind. There's usually only
+// one in use at a time, but searches may nest, and shared fields keep theirs
+// for a turn.
+#define MAX_POOLED_WORKSPACES 4
+
+// Never destroyed, so that a monster_pathfind in a static elsewhere can
+// still give its workspace back at exit.
+static vector<unique_ptr<pathfind_workspace>> &_pathfind_pool()
+{
+    static auto *pool = new vector<unique_ptr<pathfind_workspace>>;
+    return *pool;
+}
+
+static pathfind_workspace *_borrow_workspace()
+{
+    vector<unique_ptr<pathfind_workspace>> &pool = _pathfind_pool();
+    if (pool.empty())
+        return new pathfind_workspace();
+
+    pathfind_workspace *ws = pool.back().release();
+    pool.pop_back();
+    return ws;
+}
+
+static void _return_workspace(pathfind_workspace *ws)
+{
+    vector<unique_ptr<pathfind_workspace>> &pool = _pathfind_pool();
+    if (pool.size() >= MAX_POOLED_WORKSPACES)
+        delete ws;
+    else
+        pool.emplace_back(ws);
+}
+
 //#define DEBUG_PATHFIND
 monster_pathfind::monster_pathfind()
     : mons(nullptr), start(), target(), pos(), allow_diagonals(true),
       traverse_unmapped(false), range(0), min_length(0), max_length(0),
-      dist(), prev(), hash()
+      ws(_borrow_workspace())
 {
 }
 
 monster_pathfind::~monster_pathfind()
 {
+    _return_workspace(ws);
+}
+
+int monster_pathfind::get_dist(const coord_def& p) const
+{
+    const pathfind_node &node = ws->nodes[p.x][p.y];
+    return node.generation == ws->generation ? node.dist : INFINITE_DISTANCE;
+}
+
+void monster_pathfind::set_dist(const coord_def& p, int d, int from)
+{
+    pathfind_node &node = ws->nodes[p.x][p.y];
+    node.generation = ws->generation;
+    node.dist = d;
+    node.prev = from;
 }
 
 void monster_pathfind::set_range(int r)
@@ -82,7 +172,14 @@ void monster_pathfind::set_range(int r)
 
 coord_def monster_pathfind::next_pos(const coord_def &c) const
 {
-    return c + Compass[prev[c.x][c.y]];
+    return c + Compass[ws->nodes[c.x][c.y].prev];
+}
+
+static bool _traverse_in_sight(const monster* mon)
+{
+    return !crawl_state.game_is_arena()
+           && mon->friendly() && mon->is_summoned()
+           && you.see_cell_no_trans(mon->pos());
 }
 
 // The main method in the monster_pathfind class.
@@ -97,9 +194,7 @@ bool monster_pathfind::init_pathfind(const monster* mon, coord_def dest,
     pos    = start;
     allow_diagonals   = diag;
     traverse_unmapped = pass_unmapped;
-    traverse_in_sight = (!crawl_state.game_is_arena()
-                         && mon->friendly() &&  mon->is_summoned()
-                         && you.see_cell_no_trans(mon->pos()));
+    traverse_in_sight = _traverse_in_sight(mon);
 
     // Easy enough. :P
     if (start == target)
@@ -138,11 +233,9 @@ bool monster_pathfind::start_pathfind(bool msg)
     //       a wall.
 
     max_length = min_length = grid_distance(pos, target);
-    for (int i = 0; i < GXM; i++)
-        for (int j = 0; j < GYM; j++)
-            dist[i][j] = INFINITE_DISTANCE;
+    ws->new_search();
 
-    dist[pos.x][pos.y] = 0;
+    set_dist(pos, 0, 0);
 
     bool success = false;
     do
@@ -169,6 +262,132 @@ bool monster_pathfind::start_pathfind(bool msg)
     while (true);
 }
 
+// Instead of searching from one monster to dest, work out how far points
+// are from dest for monsters like mon: a Dijkstra search backwards from the
+// target, which stops once every one of sources has been reached (or can't
+// be). Afterwards, the backtracking information of each point reached
+// leads one step closer to dest, which init_from_field() can follow for
+// any number of monsters chasing the same target.
+void monster_pathfind::init_field(const monster* mon, coord_def dest,
+                                  const vector<coord_def> &sources)
+{
+    mons   = mon;
+
+    start  = dest;
+    target = dest;
+    pos    = dest;
+    allow_diagonals   = true;
+    traverse_unmapped = false;
+    traverse_in_sight = _traverse_in_sight(mon);
+
+    ws->new_search();
+    set_dist(target, 0, 0);
+    add_new_pos(target, 0);
+
+    for (int d = 0; d <= ws->hash_used; d++)
+    {
+        vector<coord_def> &bucket = ws->hash[d];
+        while (!bucket.empty())
+        {
+            const coord_def p = bucket.back();
+            bucket.pop_back();
+            // Already reached more cheaply since this was queued.
+            if (get_dist(p) < d)
+                continue;
+
+            // Look at neighbours in the same order, with the same random
+            // rotation, as calc_path_to_neighbours(), so ties between
+            // equally long paths are broken the same way.
+            const int rotate = random2(4) * 2;
+            for (int idir = 1; idir < 8; (idir += 2) == 9 && (idir = 0))
+            {
+                const int dir = (idir + rotate) % 8;
+                // npos is where a monster stepping onto p comes from.
+                const coord_def npos = p + Compass[dir];
+                if (!in_bounds(npos) || npos == target || !traversable(npos))
+                    continue;
+
+                if (range && estimated_cost(npos) > range)
+                    continue;
+
+                pos = npos;
+                const int distance = d + travel_cost(p);
+                if (range && distance > range * 2
+                    || distance >= GXM * GYM)
+                {
+                    continue;
+                }
+
+                if (distance < get_dist(npos))
+                {
+                    // Step back towards p.
+                    set_dist(npos, distance, (dir + 4) % 8);
+                    add_new_pos(npos, distance);
+                }
+            }
+        }
+
+        // Nothing left to expand can make a path to any of the sources
+        // shorter than d, so once they're all within d they're done.
+        if (all_of(sources.begin(), sources.end(),
+                   [&](const coord_def &c) { return get_dist(c) <= d; }))
+        {
+            break;
+        }
+    }
+}
+
+// Take mon's path to the target of a field built by init_field(), rather
+// than searching for one. Fails if the field never reached mon, or if the
+// way it points isn't one that mon could take (it may have been built for
+// a monster with different movement), in which case the caller should
+// search as usual. On success, backtrack() and calc_waypoints() work as
+// after init_pathfind().
+bool monster_pathfind::init_from_field(const monster* mon,
+                                       const monster_pathfind &field)
+{
+    mons   = mon;
+
+    start  = mon->pos();
+    target = field.target;
+    pos    = start;
+    allow_diagonals   = true;
+    traverse_unmapped = false;
+    traverse_in_sight = _traverse_in_sight(mon);
+
+    if (start == target)
+        return true;
+
+    ws->new_search();
+    set_dist(start, 0, 0);
+
+    int distance = 0;
+    coord_def p = start;
+    while (p != target)
+    {
+        if (field.get_dist(p) == INFINITE_DISTANCE)
+            return false;
+
+        const int dir = field.ws->nodes[p.x][p.y].prev;
+        const coord_def npos = p + Compass[dir];
+        if (!traversable(npos) && npos != target)
+            return false;
+
+        if (range && estimated_cost(npos) > range)
+            return false;
+
+        pos = p;
+        distance += travel_cost(npos);
+        if (range && distance > range * 2)
+            return false;
+
+        set_dist(npos, distance, (dir + 4) % 8);
+        p = npos;
+    }
+
+    return true;
+}
+
 // Returns true as soon as we encounter the target.
 bool monster_pathfind::calc_path_to_neighbours()
 {
@@ -212,8 +431,8 @@ bool monster_pathfind::calc_path_to_neighbours()
         if (range && estimated_cost(npos) > range)
             continue;
 
-        distance = dist[pos.x][pos.y] + travel_cost(npos);
-        old_dist = dist[npos.x][npos.y];
+        distance = get_dist(pos) + travel_cost(npos);
+        old_dist = get_dist(npos);
 
         // Also bail out if this would make the path longer than twice the
         // allowed distance from the target. (This factor may need tuning.)
@@ -254,16 +473,13 @@ bool monster_pathfind::calc_path_to_neighbours()
                 update_pos(npos, total);
             }
 
-            // Update distance start->pos.
-            dist[npos.x][npos.y] = distance;
-
-            // Set backtracking information.
+            // Update distance start->pos, and set backtracking information.
             // Converts the Compass direction to its counterpart.
             //      0  1  2         4  5  6
             //      7  .  3   ==>   3  .  7       e.g. (3 + 4) % 8          = 7
             //      6  5  4         2  1  0            (7 + 4) % 8 = 11 % 8 = 3
 
-            prev[npos.x][npos.y] = (dir + 4) % 8;
+            set_dist(npos, distance, (dir + 4) % 8);
 
             // Are we finished?
             if (npos == target)
@@ -285,12 +501,12 @@ bool monster_pathfind::get_best_position()
 {
     for (int i = min_length; i <= max_length; i++)
     {
-        if (!hash[i].empty())
+        if (!ws->hash[i].empty())
         {
             if (i > min_length)
                 min_length = i;
 
-            vector<coord_def> &vec = hash[i];
+            vector<coord_def> &vec = ws->hash[i];
             // Pick the last position pushed into the vector as it's most
             // likely to be close to the target.
             pos = vec[vec.size()-1];
@@ -329,7 +545,7 @@ vector<coord_def> monster_pathfind::backtrack()
     int dir;
     do
     {
-        dir = prev[pos.x][pos.y];
+        dir = ws->nodes[pos.x][pos.y].prev;
         pos = pos + Compass[dir];
         ASSERT_IN_BOUNDS(pos);
 #ifdef DEBUG_PATHFIND
@@ -494,16 +710,17 @@ int monster_pathfind::estimated_cost(coord_def p)
 
 void monster_pathfind::add_new_pos(coord_def npos, int total)
 {
-    hash[total].push_back(npos);
+    ws->hash[total].push_back(npos);
+    ws->hash_used = max(ws->hash_used, total);
 }
 
 void monster_pathfind::update_pos(coord_def npos, int total)
 {
     // Find hash position of old distance and delete it,
     // then call_add_new_pos.
-    int old_total = dist[npos.x][npos.y] + estimated_cost(npos);
+    int old_total = get_dist(npos) + estimated_cost(npos);
 
-    vector<coord_def> &vec = hash[old_total];
+    vector<coord_def> &vec = ws->hash[old_total];
     for (unsigned int i = 0; i < vec.size(); i++)
     {
         if (vec[i] == npos)
@@ -1,6 +1,7 @@
 #pragma once
 
 class monster;
+struct pathfind_workspace;
 
 int mons_tracking_range(const monster* mon);
 
@@ -9,6 +10,7 @@ class monster_pathfind
 public:
     monster_pathfind();
     virtual ~monster_pathfind();
+    DISALLOW_COPY_AND_ASSIGN(monster_pathfind);
 
     // public methods
     void set_range(int r);
@@ -19,6 +21,9 @@ public:
     bool init_pathfind(coord_def src, coord_def dest,
                        bool diag = true, bool msg = false);
     bool start_pathfind(bool msg = false);
+    void init_field(const monster* mon, coord_def dest,
+                    const vector<coord_def> &sources);
+    bool init_from_field(const monster* mon, const monster_pathfind &field);
     vector<coord_def> backtrack();
     vector<coord_def> calc_waypoints();
 
@@ -33,6 +38,8 @@ protected:
     void add_new_pos(coord_def pos, int total);
     void update_pos(coord_def pos, int total);
     bool get_best_position();
+    int  get_dist(const coord_def& p) const;
+    void set_dist(const coord_def& p, int d, int from);
 
     // The monster trying to find a path.
     const monster* mons;
@@ -59,10 +66,7 @@ protected:
     int min_length;
     int max_length;
 
-    // The array of distances from start to any already tried point.
-    int dist[GXM][GYM];
-    // An array to store where we came from on a given shortest path.
-    int prev[GXM][GYM];
-
-    FixedVector<vector<coord_def>, GXM * GYM> hash;
+    // The distances, backtracking information and open list, borrowed
+    // from a pool for as long as this object lives.
+    pathfind_workspace *ws;
 };
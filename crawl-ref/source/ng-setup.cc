@@ -1141,4 +1141,5 @@ static void _setup_generic(const newgame_def& ng,
     else
         you.save = new package(get_savedir_filename(you.your_name).c_str(),
                                true, true);
+    set_save_compression(*you.save);
 }
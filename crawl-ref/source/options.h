@@ -175,6 +175,7 @@ public:
     uint64_t    seed_from_rc;
     bool        pregen_dungeon; // Is the dungeon completely generated at the beginning?
     bool        incremental_pregen; // Does the dungeon always generate in a specified order?
+    bool        speculative_pregen; // Build the level below while the player is idle?
 
 #ifdef DGL_SIMPLE_MESSAGING
     bool        messaging;      // Check for messages.
@@ -184,6 +185,10 @@ public:
 
     bool        mouse_input;
 
+    int         los_cache_size; // in kilobytes
+    string      save_compression;       // codec for new saves
+    int         save_compression_level; // 0 for the codec's default
+
     int         view_max_width;
     int         view_max_height;
     int         mlist_min_height;
@@ -16,6 +16,11 @@ Notes:
 * Readers always get the last complete (but not necessarily committed) write
   (ie, READ_UNCOMMITTED) at the time they started; it is safe to continue
   reading even if the chunk has been changed since.
+* commit_async() does its writing and syncing on a thread of its own; every
+  other entry point waits for it first, so callers see the same ordering as
+  with commit(). Nothing the thread runs may ASSERT or die(): it checks
+  what it needs before starting the thread, and failures on the thread are
+  exceptions, reported on the main thread by await_commit().
 */
 
 #include "AppHdr.h"
@@ -27,15 +32,29 @@ Notes:
 #include <cstring>
 #include <sstream>
 #include <fcntl.h>
+#include <functional>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifndef TARGET_OS_WINDOWS
+#include <sys/mman.h>
+#endif
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
 
 #include "end.h"
 #include "endianness.h"
 #include "errors.h"
 #include "syscalls.h"
 #include "libutil.h" // map_find
+#include "threads.h"
 
 // debugging defines
 #undef  FSCK_VERBOSE
@@ -44,11 +63,10 @@ Notes:
 
 static plen_t htole(plen_t x)
 {
+    COMPILE_CHECK(sizeof(plen_t) == 4 || sizeof(plen_t) == 8);
     if (sizeof(plen_t) == 4)
         return htole32(x);
-    if (sizeof(plen_t) == 8)
-        return htole64(x);
-    die("unsupported plen_t size");
+    return htole64(x);
 }
 
 #ifdef DEBUG_PACKAGE
@@ -64,7 +82,8 @@ struct file_header
 {
     uint32_t magic;
     uint8_t version;
-    char padding[3];
+    uint8_t codec;      // a save_codec; zero in saves from before codecs
+    char padding[2];
     plen_t start;
 };
 
@@ -79,11 +98,567 @@ typedef pair<plen_t, plen_t> bm_p;
 typedef map<plen_t, bm_p> bm_t;
 typedef map<plen_t, plen_t> fb_t;
 
+/* ***********************************************************************
+ * Compression codecs
+ * *********************************************************************** */
+
+static const char *codec_names[] =
+{
+    "zlib", "zstd", "lz4",
+};
+COMPILE_CHECK(ARRAYSZ(codec_names) == NUM_SAVE_CODECS);
+
+const char *save_codec_name(save_codec codec)
+{
+    ASSERT_RANGE(codec, 0, NUM_SAVE_CODECS);
+    return codec_names[codec];
+}
+
+/// The codec with this name, or NUM_SAVE_CODECS if there's none.
+save_codec save_codec_by_name(const string &name)
+{
+    for (int i = 0; i < NUM_SAVE_CODECS; ++i)
+        if (name == codec_names[i])
+            return static_cast<save_codec>(i);
+    return NUM_SAVE_CODECS;
+}
+
+/// Was this build compiled with support for the codec?
+bool save_codec_available(save_codec codec)
+{
+    switch (codec)
+    {
+    case SAVE_CODEC_ZLIB:
+        return true;
+#ifdef USE_ZSTD
+    case SAVE_CODEC_ZSTD:
+        return true;
+#endif
+#ifdef USE_LZ4
+    case SAVE_CODEC_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * The highest compression level the codec accepts. 0 always means the
+ * codec's default.
+ */
+int save_codec_max_level(save_codec codec)
+{
+    switch (codec)
+    {
+    case SAVE_CODEC_ZLIB:
+        return 9;
+    case SAVE_CODEC_ZSTD:
+        return 22;
+    case SAVE_CODEC_LZ4:
+        return 12; // LZ4HC_CLEVEL_MAX
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Compresses a chunk's data. Output goes to the sink in pieces of ZB_SIZE,
+ * save for the last, so that every codec lays chunks out on disk the same
+ * way.
+ */
+class chunk_encoder
+{
+public:
+    typedef function<void(const void *, plen_t)> sink_t;
+
+    chunk_encoder(sink_t _sink) : sink(_sink), out(ZB_SIZE), out_len(0) {}
+    virtual ~chunk_encoder() {}
+
+    virtual void write(const void *data, plen_t len) = 0;
+    // Compress whatever is left and end the stream.
+    virtual void finish() = 0;
+
+protected:
+    unsigned char *space() { return &out[out_len]; }
+    plen_t space_left() const { return ZB_SIZE - out_len; }
+
+    // The codec wrote n bytes into space().
+    void produced(plen_t n)
+    {
+        out_len += n;
+        if (out_len == ZB_SIZE)
+            drain();
+    }
+
+    void emit(const void *data, plen_t len)
+    {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        while (len)
+        {
+            const plen_t n = min(len, space_left());
+            memcpy(space(), p, n);
+            p += n;
+            len -= n;
+            produced(n);
+        }
+    }
+
+    void drain()
+    {
+        if (out_len)
+            sink(&out[0], out_len);
+        out_len = 0;
+    }
+
+private:
+    sink_t sink;
+    vector<unsigned char> out;
+    plen_t out_len;
+};
+
+/**
+ * Decompresses a chunk, pulling compressed data from the source as needed.
+ */
+class chunk_decoder
+{
+public:
+    typedef function<plen_t(void *, plen_t)> source_t;
+
+    chunk_decoder(source_t _source) : source(_source), eof(false) {}
+    virtual ~chunk_decoder() {}
+
+    // Returns less than len only at the end of the chunk.
+    virtual plen_t read(void *data, plen_t len) = 0;
+
+protected:
+    source_t source;
+    bool eof;
+};
+
+#ifdef USE_ZLIB
+// zlib only sets msg for some errors.
+static const char *_zlib_error(const z_stream &zs, int res)
+{
+    return zs.msg ? zs.msg : zError(res);
+}
+
+class zlib_encoder : public chunk_encoder
+{
+public:
+    zlib_encoder(sink_t _sink, int level) : chunk_encoder(_sink)
+    {
+        zs.data_type = Z_BINARY;
+        zs.zalloc    = 0;
+        zs.zfree     = 0;
+        zs.opaque    = Z_NULL;
+        const int res = deflateInit(&zs, level ? level
+                                               : Z_DEFAULT_COMPRESSION);
+        if (res != Z_OK)
+        {
+            fail("save file compression failed during init: %s",
+                 _zlib_error(zs, res));
+        }
+        zs.next_out  = space();
+        zs.avail_out = space_left();
+    }
+
+    ~zlib_encoder()
+    {
+        // ignore errors, they're not relevant anymore
+        deflateEnd(&zs);
+    }
+
+    void write(const void *data, plen_t len) override
+    {
+        zs.next_in  = (Bytef*)data;
+        zs.avail_in = len;
+        while (zs.avail_in)
+        {
+            if (!zs.avail_out)
+                sync_output();
+            // we don't allow Z_BUF_ERROR, so it's fatal for us
+            const int res = deflate(&zs, Z_NO_FLUSH);
+            if (res != Z_OK)
+                fail("save file compression failed: %s", _zlib_error(zs, res));
+        }
+    }
+
+    void finish() override
+    {
+        zs.avail_in = 0;
+        int res;
+        do
+        {
+            res = deflate(&zs, Z_FINISH);
+            if (res != Z_STREAM_END && res != Z_OK && res != Z_BUF_ERROR)
+                fail("save file compression failed: %s", _zlib_error(zs, res));
+            sync_output();
+        } while (res != Z_STREAM_END);
+        drain();
+    }
+
+private:
+    // Account for what deflate wrote, and point it at the free space.
+    void sync_output()
+    {
+        produced(space_left() - zs.avail_out);
+        zs.next_out  = space();
+        zs.avail_out = space_left();
+    }
+
+    z_stream zs;
+};
+
+class zlib_decoder : public chunk_decoder
+{
+public:
+    zlib_decoder(source_t _source) : chunk_decoder(_source)
+    {
+        zs.zalloc    = 0;
+        zs.zfree     = 0;
+        zs.opaque    = Z_NULL;
+        zs.next_in   = Z_NULL;
+        zs.avail_in  = 0;
+        const int res = inflateInit(&zs);
+        if (res != Z_OK)
+        {
+            fail("save file decompression failed during init: %s",
+                 _zlib_error(zs, res));
+        }
+    }
+
+    ~zlib_decoder()
+    {
+        inflateEnd(&zs);
+    }
+
+    plen_t read(void *data, plen_t len) override
+    {
+        if (!len || eof)
+            return 0;
+
+        zs.next_out  = (Bytef*)data;
+        zs.avail_out = len;
+        while (zs.avail_out)
+        {
+            if (!zs.avail_in)
+            {
+                zs.next_in  = z_buffer;
+                zs.avail_in = source(z_buffer, sizeof(z_buffer));
+                if (!zs.avail_in)
+                    corrupted("save file corrupted -- block truncated");
+            }
+            int res = inflate(&zs, Z_NO_FLUSH);
+            if (res == Z_STREAM_END)
+            {
+                eof = true;
+                break;
+            }
+            if (res != Z_OK)
+            {
+                corrupted("save file decompression failed: %s",
+                          _zlib_error(zs, res));
+            }
+        }
+        return zs.next_out - (Bytef*)data;
+    }
+
+private:
+    z_stream zs;
+    Bytef z_buffer[ZB_SIZE];
+};
+#else
+// Without zlib, "zlib" chunks are stored as they are.
+class zlib_encoder : public chunk_encoder
+{
+public:
+    zlib_encoder(sink_t _sink, int) : chunk_encoder(_sink) {}
+    void write(const void *data, plen_t len) override { emit(data, len); }
+    void finish() override { drain(); }
+};
+
+class zlib_decoder : public chunk_decoder
+{
+public:
+    zlib_decoder(source_t _source) : chunk_decoder(_source) {}
+    plen_t read(void *data, plen_t len) override { return source(data, len); }
+};
+#endif
+
+#ifdef USE_ZSTD
+class zstd_encoder : public chunk_encoder
+{
+public:
+    zstd_encoder(sink_t _sink, int level) : chunk_encoder(_sink)
+    {
+        cctx = ZSTD_createCCtx();
+        if (!cctx)
+            fail("save file compression failed during init");
+        if (level)
+            check(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level));
+    }
+
+    ~zstd_encoder()
+    {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    void write(const void *data, plen_t len) override
+    {
+        ZSTD_inBuffer in = { data, len, 0 };
+        while (in.pos < in.size)
+            compress(in, ZSTD_e_continue);
+    }
+
+    void finish() override
+    {
+        ZSTD_inBuffer in = { nullptr, 0, 0 };
+        while (compress(in, ZSTD_e_end))
+            ;
+        drain();
+    }
+
+private:
+    // Returns how much zstd has left to flush.
+    size_t compress(ZSTD_inBuffer &in, ZSTD_EndDirective mode)
+    {
+        ZSTD_outBuffer dst = { space(), space_left(), 0 };
+        const size_t left = check(ZSTD_compressStream2(cctx, &dst, &in, mode));
+        produced(dst.pos);
+        return left;
+    }
+
+    static size_t check(size_t res)
+    {
+        if (ZSTD_isError(res))
+            fail("save file compression failed: %s", ZSTD_getErrorName(res));
+        return res;
+    }
+
+    ZSTD_CCtx *cctx;
+};
+
+class zstd_decoder : public chunk_decoder
+{
+public:
+    zstd_decoder(source_t _source)
+        : chunk_decoder(_source), in{ z_buffer, 0, 0 }, more_output(false)
+    {
+        dctx = ZSTD_createDCtx();
+        if (!dctx)
+            fail("save file decompression failed during init");
+    }
+
+    ~zstd_decoder()
+    {
+        ZSTD_freeDCtx(dctx);
+    }
+
+    plen_t read(void *data, plen_t len) override
+    {
+        if (!len || eof)
+            return 0;
+
+        ZSTD_outBuffer out = { data, len, 0 };
+        while (out.pos < out.size)
+        {
+            // zstd may hold decoded data back when the output fills up; let
+            // it flush that before asking for more input.
+            if (in.pos == in.size && !more_output)
+            {
+                in.size = source(z_buffer, sizeof(z_buffer));
+                in.pos = 0;
+                if (!in.size)
+                    corrupted("save file corrupted -- block truncated");
+            }
+            const size_t res = ZSTD_decompressStream(dctx, &out, &in);
+            if (ZSTD_isError(res))
+            {
+                corrupted("save file decompression failed: %s",
+                          ZSTD_getErrorName(res));
+            }
+            if (!res)
+            {
+                eof = true;
+                break;
+            }
+            more_output = out.pos == out.size;
+        }
+        return out.pos;
+    }
+
+private:
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer in;
+    bool more_output;
+    unsigned char z_buffer[ZB_SIZE];
+};
+#endif
+
+#ifdef USE_LZ4
+class lz4_encoder : public chunk_encoder
+{
+public:
+    lz4_encoder(sink_t _sink, int level) : chunk_encoder(_sink)
+    {
+        if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))
+            fail("save file compression failed during init");
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = level;
+        tmp.resize(LZ4F_compressBound(ZB_SIZE, &prefs));
+        emit(&tmp[0], check(LZ4F_compressBegin(cctx, &tmp[0], tmp.size(),
+                                               &prefs)));
+    }
+
+    ~lz4_encoder()
+    {
+        LZ4F_freeCompressionContext(cctx);
+    }
+
+    void write(const void *data, plen_t len) override
+    {
+        const char *p = static_cast<const char *>(data);
+        while (len)
+        {
+            // tmp has room for the worst case of ZB_SIZE bytes of input.
+            const plen_t n = min<plen_t>(len, ZB_SIZE);
+            emit(&tmp[0], check(LZ4F_compressUpdate(cctx, &tmp[0], tmp.size(),
+                                                    p, n, nullptr)));
+            p += n;
+            len -= n;
+        }
+    }
+
+    void finish() override
+    {
+        emit(&tmp[0], check(LZ4F_compressEnd(cctx, &tmp[0], tmp.size(),
+                                             nullptr)));
+        drain();
+    }
+
+private:
+    static size_t check(size_t res)
+    {
+        if (LZ4F_isError(res))
+            fail("save file compression failed: %s", LZ4F_getErrorName(res));
+        return res;
+    }
+
+    LZ4F_cctx *cctx;
+    LZ4F_preferences_t prefs;
+    vector<char> tmp;
+};
+
+class lz4_decoder : public chunk_decoder
+{
+public:
+    lz4_decoder(source_t _source)
+        : chunk_decoder(_source), in_pos(0), in_len(0), more_output(false)
+    {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+            fail("save file decompression failed during init");
+    }
+
+    ~lz4_decoder()
+    {
+        LZ4F_freeDecompressionContext(dctx);
+    }
+
+    plen_t read(void *data, plen_t len) override
+    {
+        if (!len || eof)
+            return 0;
+
+        char *out = static_cast<char *>(data);
+        plen_t got = 0;
+        while (got < len)
+        {
+            // As with zstd, let buffered output out before refilling.
+            if (in_pos == in_len && !more_output)
+            {
+                in_len = source(z_buffer, sizeof(z_buffer));
+                in_pos = 0;
+                if (!in_len)
+                    corrupted("save file corrupted -- block truncated");
+            }
+            size_t out_size = len - got;
+            size_t in_size = in_len - in_pos;
+            const size_t res = LZ4F_decompress(dctx, out + got, &out_size,
+                                               z_buffer + in_pos, &in_size,
+                                               nullptr);
+            if (LZ4F_isError(res))
+            {
+                corrupted("save file decompression failed: %s",
+                          LZ4F_getErrorName(res));
+            }
+            in_pos += in_size;
+            got += out_size;
+            if (!res)
+            {
+                eof = true;
+                break;
+            }
+            more_output = got == len;
+        }
+        return got;
+    }
+
+private:
+    LZ4F_dctx *dctx;
+    plen_t in_pos, in_len;
+    bool more_output;
+    char z_buffer[ZB_SIZE];
+};
+#endif
+
+static chunk_encoder *_make_encoder(save_codec codec, int level,
+                                    chunk_encoder::sink_t sink)
+{
+    switch (codec)
+    {
+#ifdef USE_ZSTD
+    case SAVE_CODEC_ZSTD:
+        return new zstd_encoder(sink, level);
+#endif
+#ifdef USE_LZ4
+    case SAVE_CODEC_LZ4:
+        return new lz4_encoder(sink, level);
+#endif
+    case SAVE_CODEC_ZLIB:
+        return new zlib_encoder(sink, level);
+    default:
+        die("unsupported save codec %d", codec);
+    }
+}
+
+static chunk_decoder *_make_decoder(save_codec codec,
+                                    chunk_decoder::source_t source)
+{
+    switch (codec)
+    {
+#ifdef USE_ZSTD
+    case SAVE_CODEC_ZSTD:
+        return new zstd_decoder(source);
+#endif
+#ifdef USE_LZ4
+    case SAVE_CODEC_LZ4:
+        return new lz4_decoder(source);
+#endif
+    case SAVE_CODEC_ZLIB:
+        return new zlib_decoder(source);
+    default:
+        die("unsupported save codec %d", codec);
+    }
+}
+
 package::package(const char* file, bool writeable, bool empty)
-  : n_users(0), dirty(false), aborted(false)
+  : n_users(0), dirty(false), aborted(false), codec(SAVE_CODEC_ZLIB),
+    codec_level(0), map_data(nullptr), map_len(0),
 #ifdef DO_FSYNC
-    , tmp(false)
+    tmp(false),
 #endif
+    in_flight(nullptr)
 {
     dprintf("package: initializing file=\"%s\" rw=%d\n", file, writeable);
     ASSERT(writeable || !empty);
@@ -119,10 +694,13 @@ package::package(const char* file, bool writeable, bool empty)
                     "Another game is already in progress using this save!");
             }
 
+            if (!writeable)
+                map_file();
             load();
         }
         catch (exception &e)
         {
+            unmap_file();
             close(fd);
             throw;
         }
@@ -130,10 +708,12 @@ package::package(const char* file, bool writeable, bool empty)
 }
 
 package::package()
-  : rw(true), n_users(0), dirty(false), aborted(false)
+  : rw(true), n_users(0), dirty(false), aborted(false),
+    codec(SAVE_CODEC_ZLIB), codec_level(0), map_data(nullptr), map_len(0),
 #ifdef DO_FSYNC
-    , tmp(true)
+    tmp(true),
 #endif
+    in_flight(nullptr)
 {
     dprintf("package: initializing tmp file\n");
     filename = "[tmp]";
@@ -161,8 +741,8 @@ void package::load()
     ssize_t res = ::read(fd, &head, sizeof(file_header));
     if (res < 0)
         sysfail("error reading the save file (%s)", filename.c_str());
-    if (!res || !(head.magic || head.version || head.padding[0]
-                  || head.padding[1] || head.padding[2] || head.start))
+    if (!res || !(head.magic || head.version || head.codec
+                  || head.padding[0] || head.padding[1] || head.start))
     {
         corrupted("The save file (%s) is empty!", filename.c_str());
     }
@@ -174,6 +754,18 @@ void package::load()
         corrupted("save file (%s) corrupted -- not a DCSS save file",
              filename.c_str());
     }
+    if (head.codec >= NUM_SAVE_CODECS)
+    {
+        corrupted("save file (%s) corrupted -- unknown compression",
+                  filename.c_str());
+    }
+    codec = static_cast<save_codec>(head.codec);
+    if (!save_codec_available(codec))
+    {
+        fail("save file (%s) uses %s compression, which this build lacks",
+             filename.c_str(), save_codec_name(codec));
+    }
+
     off_t len = lseek(fd, 0, SEEK_END);
     if (len == -1)
         sysfail("save file (%s) is not seekable", filename.c_str());
@@ -219,6 +811,8 @@ package::~package()
             sysfail("failed to update save file");
     }
 
+    unmap_file();
+
     // all errors here should be cached write errors
     if (fd != -1)
         if (close(fd) && !aborted)
@@ -230,6 +824,124 @@ package::~package()
 }
 
 void package::commit()
+{
+    await_commit();
+    do_commit();
+}
+
+/**
+ * A checkpoint being stored by the I/O thread. Compressing, writing and
+ * above all syncing the save can take long enough to be felt, so the game
+ * hands its freshly marshalled chunks over and carries on.
+ */
+struct package::commit_job
+{
+    package *pkg;
+    chunk_list chunks;
+    function<void()> on_commit;
+    string error;
+    thread_t thread;
+};
+
+void *package::_run_commit(void *arg)
+{
+    commit_job *job = static_cast<commit_job *>(arg);
+    try
+    {
+        job->pkg->write_chunks(job->chunks);
+        job->pkg->write_commit();
+        if (job->on_commit)
+            job->on_commit();
+    }
+    catch (exception &e)
+    {
+        // Errors are reported on the main thread, by await_commit().
+        job->error = e.what();
+    }
+    catch (...)
+    {
+        job->error = "unknown error while saving";
+    }
+    return nullptr;
+}
+
+/**
+ * Store these chunks and commit, in the background. The chunks are taken
+ * from the list. Until the commit is done, any other use of the package
+ * waits for it, so it sees exactly what a synchronous commit would leave.
+ * If given, on_commit is called once the commit has succeeded; it may run
+ * on the I/O thread, so it must not touch game state.
+ */
+void package::commit_async(chunk_list &chunks, function<void()> on_commit)
+{
+    await_commit();
+    // Everything the thread would otherwise have to check.
+    ASSERT(rw);
+    ASSERT(!aborted);
+    ASSERT(save_codec_available(codec));
+#ifdef ASSERTS
+    for (const auto &chunk : chunks)
+        ASSERT(chunk.first.length() < MAX_CHUNK_NAME_LENGTH);
+#endif
+#ifdef COSTLY_ASSERTS
+    fsck();
+#endif
+
+    unique_ptr<commit_job> job(new commit_job);
+    job->pkg = this;
+    job->chunks.swap(chunks);
+    job->on_commit = on_commit;
+
+    // Open readers and writers share the file offset, so they'd race the
+    // thread; and without a thread we simply do the work here.
+    if (n_users
+        || thread_create_joinable(&job->thread, _run_commit, job.get()))
+    {
+        write_chunks(job->chunks);
+        do_commit();
+        if (on_commit)
+            on_commit();
+        return;
+    }
+    in_flight = job.release();
+}
+
+/// Wait for a background commit, if any, and report its errors.
+void package::await_commit()
+{
+    if (!in_flight)
+        return;
+
+    unique_ptr<commit_job> job(in_flight);
+    in_flight = nullptr;
+    thread_join(job->thread);
+
+    if (!job->error.empty())
+        fail("%s", job->error.c_str());
+#ifdef COSTLY_ASSERTS
+    fsck();
+#endif
+}
+
+/**
+ * Store chunks for commit_async(), possibly on its thread. Each is
+ * compressed in memory first and its writer closed explicitly, so that a
+ * failure is thrown from here rather than from a destructor.
+ */
+void package::write_chunks(const chunk_list &chunks)
+{
+    vector<unsigned char> zdata;
+    for (const auto &chunk : chunks)
+    {
+        compress_chunk_data(chunk.second, zdata, codec, codec_level);
+        chunk_writer cw(this, chunk.first, true);
+        for (size_t at = 0; at < zdata.size(); at += ZB_SIZE)
+            cw.raw_write(&zdata[at], min<size_t>(ZB_SIZE, zdata.size() - at));
+        cw.close();
+    }
+}
+
+void package::do_commit()
 {
     ASSERT(rw);
     if (!dirty)
@@ -240,9 +952,23 @@ void package::commit()
     fsck();
 #endif
 
+    write_commit();
+
+#ifdef COSTLY_ASSERTS
+    fsck();
+#endif
+}
+
+/// The unchecked part of do_commit(), which commit_async()'s thread runs.
+void package::write_commit()
+{
+    if (!dirty)
+        return;
+
     file_header head;
     head.magic = htole(PACKAGE_MAGIC);
     head.version = PACKAGE_VERSION;
+    head.codec = codec;
     memset(&head.padding, 0, sizeof(head.padding));
     head.start = htole(write_directory());
 #ifdef DO_FSYNC
@@ -261,10 +987,69 @@ void package::commit()
     new_chunks.clear();
     collect_blocks();
     dirty = false;
+}
 
-#ifdef COSTLY_ASSERTS
-    fsck();
+/**
+ * Choose how chunks written from now on are compressed. Every chunk in a
+ * package has to share one codec, so the codec itself can only change while
+ * the package is still empty; the level can change at any time.
+ */
+void package::set_codec(save_codec new_codec, int level)
+{
+    await_commit();
+    ASSERT(rw);
+    ASSERT(save_codec_available(new_codec));
+    if (new_codec != codec)
+    {
+        ASSERT(list_chunks().empty());
+        codec = new_codec;
+        dirty = true;
+    }
+    codec_level = level;
+}
+
+/**
+ * Read-only packages are read through a memory map where the system has
+ * them: each block then costs a copy out of the page cache rather than a
+ * seek and a read. Without a map, reads go through the file descriptor.
+ */
+void package::map_file()
+{
+#ifndef TARGET_OS_WINDOWS
+    ASSERT(!rw);
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0 || st.st_size > (off_t)(plen_t)-1)
+        return;
+
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return;
+    map_data = static_cast<const unsigned char *>(addr);
+    map_len = st.st_size;
+#endif
+}
+
+void package::unmap_file()
+{
+#ifndef TARGET_OS_WINDOWS
+    if (map_data)
+        munmap(const_cast<unsigned char *>(map_data), map_len);
 #endif
+    map_data = nullptr;
+    map_len = 0;
+}
+
+/// Copy from the mapped file, returning how much was there to copy.
+ssize_t package::read_mapped(plen_t at, void *buf, plen_t size)
+{
+    ASSERT(map_data);
+    if (at > file_len)
+        corrupted("save file corrupted -- invalid offset");
+    if (at >= map_len)
+        return 0;
+    size = min(size, map_len - at);
+    memcpy(buf, map_data + at, size);
+    return size;
 }
 
 void package::seek(plen_t to)
@@ -279,16 +1064,33 @@ void package::seek(plen_t to)
 
 chunk_writer* package::writer(const string &name)
 {
+    await_commit();
     return new chunk_writer(this, name);
 }
 
 chunk_reader* package::reader(const string &name)
 {
+    await_commit();
     if (plen_t *ch = map_find(directory, name))
         return new chunk_reader(this, *ch);
     return 0;
 }
 
+/**
+ * Store a chunk whose contents were already compressed by
+ * compress_chunk_data(). The data is fed to the disk in the same pieces a
+ * chunk_writer would use, so the resulting layout is identical to writing
+ * the uncompressed data directly.
+ */
+void package::write_compressed_chunk(const string &name,
+                                     const vector<unsigned char> &zdata)
+{
+    await_commit();
+    chunk_writer cw(this, name, true);
+    for (size_t at = 0; at < zdata.size(); at += ZB_SIZE)
+        cw.raw_write(&zdata[at], min<size_t>(ZB_SIZE, zdata.size() - at));
+}
+
 plen_t package::extend_block(plen_t at, plen_t size, plen_t by)
 {
     // the header is not counted into the block's size, yet takes space
@@ -382,13 +1184,39 @@ void package::free_chunk(const string &name)
 
 void package::delete_chunk(const string &name)
 {
+    await_commit();
     free_chunk(name);
     directory.erase(name);
+    fingerprints.erase(name);
+}
+
+/**
+ * Remember a fingerprint of what the caller stored in a chunk, or read from
+ * it, so it can tell later whether writing the chunk again would change
+ * anything. Fingerprints live only as long as the package object, and are
+ * dropped with their chunk. The I/O thread never touches them, so these
+ * don't wait for it.
+ */
+void package::set_fingerprint(const string &name, uint64_t fingerprint)
+{
+    fingerprints[name] = fingerprint;
+}
+
+bool package::get_fingerprint(const string &name, uint64_t &fingerprint) const
+{
+    auto fi = fingerprints.find(name);
+    if (fi == fingerprints.end())
+        return false;
+    fingerprint = fi->second;
+    return true;
 }
 
 plen_t package::write_directory()
 {
-    delete_chunk("");
+    // Not delete_chunk(): this runs on the I/O thread, which mustn't wait
+    // for itself.
+    free_chunk("");
+    directory.erase("");
 
     stringstream dir;
     for (const auto &entry : directory)
@@ -400,11 +1228,13 @@ plen_t package::write_directory()
         dir.write((const char*)&start, sizeof(plen_t));
     }
 
-    ASSERT(dir.str().size());
+    if (dir.str().empty())
+        fail("save file has no chunks to commit");
     dprintf("writing directory (%u bytes)\n", (unsigned int)dir.str().size());
     {
         chunk_writer dch(this, "");
         dch.write(&dir.str()[0], dir.str().size());
+        dch.close();
     }
 
     return directory[""];
@@ -436,7 +1266,8 @@ void package::free_block_chain(plen_t at)
     while (at)
     {
         auto bl = block_map.find(at);
-        ASSERT(bl != block_map.end());
+        if (bl == block_map.end())
+            fail("save file block map is inconsistent");
         dprintf("+- at %d size=%d+header\n", at, bl->second.first);
         free_block(at, bl->second.first + sizeof(block_header));
         at = bl->second.second;
@@ -444,16 +1275,18 @@ void package::free_block_chain(plen_t at)
     }
 }
 
+// This runs on the I/O thread, so inconsistencies are thrown, not ASSERTed.
 void package::free_block(plen_t at, plen_t size)
 {
-    ASSERT(at >= sizeof(file_header));
-    ASSERT(at + size <= file_len);
+    if (at < sizeof(file_header) || at + size > file_len)
+        fail("save file block map is inconsistent");
 
     auto neigh = free_blocks.lower_bound(at);
     if (neigh != free_blocks.begin())
     {
         --neigh;
-        ASSERT(neigh->first + neigh->second <= at);
+        if (neigh->first + neigh->second > at)
+            fail("save file block map is inconsistent");
         if (neigh->first + neigh->second == at)
         {
             // combine with the left neighbour
@@ -466,7 +1299,8 @@ void package::free_block(plen_t at, plen_t size)
     neigh = free_blocks.lower_bound(at);
     if (neigh != free_blocks.end())
     {
-        ASSERT(neigh->first >= at + size);
+        if (neigh->first < at + size)
+            fail("save file block map is inconsistent");
         if (neigh->first == at + size)
         {
             // combine with the right neighbour
@@ -562,11 +1396,13 @@ void package::read_directory(plen_t start, uint8_t version)
 
 bool package::has_chunk(const string &name)
 {
+    await_commit();
     return !name.empty() && directory.count(name);
 }
 
 vector<string> package::list_chunks()
 {
+    await_commit();
     vector<string> list;
     list.reserve(directory.size());
     for (const auto &entry : directory)
@@ -617,20 +1453,34 @@ void package::abort()
     // Disable any further operations, allow a shutdown. All errors past
     // this point are ignored (assuming we already failed). All writes since
     // the last commit() are lost.
+    if (in_flight)
+    {
+        thread_join(in_flight->thread);
+        delete in_flight;
+        in_flight = nullptr;
+    }
     aborted = true;
 }
 
 void package::unlink()
 {
     abort();
+    unmap_file();
     close(fd);
     fd = -1;
     ::unlink_u(filename.c_str());
 }
 
 // the amount of free space not at the end of file
+plen_t package::get_size()
+{
+    await_commit();
+    return file_len;
+}
+
 plen_t package::get_slack()
 {
+    await_commit();
     load_traces();
 
     plen_t slack = 0;
@@ -641,6 +1491,7 @@ plen_t package::get_slack()
 
 plen_t package::get_chunk_fragmentation(const string &name)
 {
+    await_commit();
     load_traces();
     ASSERT(directory.count(name)); // not has_chunk(), "" is valid
     plen_t frags = 0;
@@ -657,6 +1508,7 @@ plen_t package::get_chunk_fragmentation(const string &name)
 
 plen_t package::get_chunk_compressed_length(const string &name)
 {
+    await_commit();
     load_traces();
     ASSERT(directory.count(name)); // not has_chunk(), "" is valid
     plen_t len = 0;
@@ -671,8 +1523,10 @@ plen_t package::get_chunk_compressed_length(const string &name)
     return len;
 }
 
-chunk_writer::chunk_writer(package *parent, const string &_name)
-    : first_block(0), cur_block(0), block_len(0)
+chunk_writer::chunk_writer(package *parent, const string &_name,
+                           bool _precompressed)
+    : first_block(0), cur_block(0), block_len(0),
+      precompressed(_precompressed), closed(false)
 {
     ASSERT(parent);
     ASSERT(!parent->aborted);
@@ -686,51 +1540,45 @@ chunk_writer::chunk_writer(package *parent, const string &_name)
     pkg->n_users++;
     name = _name;
 
-#ifdef USE_ZLIB
-    zs.data_type = Z_BINARY;
-    zs.zalloc    = 0;
-    zs.zfree     = 0;
-    zs.opaque    = Z_NULL;
-    if (deflateInit(&zs, Z_DEFAULT_COMPRESSION))
-        fail("save file compression failed during init: %s", zs.msg);
-#define ZB_SIZE 32768
-    zs.next_out  = z_buffer = (Bytef*)malloc(ZB_SIZE);
-    zs.avail_out = ZB_SIZE;
-#endif
+    encoder = nullptr;
+    if (precompressed)
+        return;
+    encoder = _make_encoder(pkg->codec, pkg->codec_level,
+                            [this](const void *data, plen_t len)
+                            {
+                                raw_write(data, len);
+                            });
 }
 
 chunk_writer::~chunk_writer()
+{
+    if (closed)
+        return;
+    if (uncaught_exception())
+    {
+        // Finishing could throw again, which would end the program; the
+        // chunk is simply never added.
+        pkg->n_users--;
+        delete encoder;
+        return;
+    }
+    close();
+}
+
+/// Finish the chunk and add it to the package's directory.
+void chunk_writer::close()
 {
     dprintf("chunk_writer(%s): closing\n", name.c_str());
 
-    ASSERT(pkg->n_users > 0);
+    closed = true;
     pkg->n_users--;
+    unique_ptr<chunk_encoder> enc(encoder);
+    encoder = nullptr;
     if (pkg->aborted)
-    {
-#ifdef USE_ZLIB
-        // ignore errors, they're not relevant anymore
-        deflateEnd(&zs);
-        free(z_buffer);
-#endif
-        return;
-    }
+        return; // drop whatever the encoder still holds
 
-#ifdef USE_ZLIB
-    zs.avail_in = 0;
-    int res;
-    do
-    {
-        res = deflate(&zs, Z_FINISH);
-        if (res != Z_STREAM_END && res != Z_OK && res != Z_BUF_ERROR)
-            fail("save file compression failed: %s", zs.msg);
-        raw_write(z_buffer, zs.next_out - z_buffer);
-        zs.next_out = z_buffer;
-        zs.avail_out = ZB_SIZE;
-    } while (res != Z_STREAM_END);
-    if (deflateEnd(&zs) != Z_OK)
-        fail("save file compression failed during clean-up: %s", zs.msg);
-    free(z_buffer);
-#endif
+    if (enc)
+        enc->finish();
     if (cur_block)
         finish_block(0);
     pkg->finish_chunk(name, first_block);
@@ -744,7 +1592,8 @@ void chunk_writer::raw_write(const void *data, plen_t len)
         if (!space)
         {
             plen_t next_block = pkg->alloc_block(space = len);
-            ASSERT(space > 0);
+            if (!space)
+                fail("save file block map is inconsistent");
             if (cur_block)
                 finish_block(next_block);
             cur_block = next_block;
@@ -779,25 +1628,9 @@ void chunk_writer::write(const void *data, plen_t len)
 {
     ASSERT(data);
     ASSERT(!pkg->aborted);
+    ASSERT(!precompressed);
 
-#ifdef USE_ZLIB
-    zs.next_in  = (Bytef*)data;
-    zs.avail_in = len;
-    while (zs.avail_in)
-    {
-        if (!zs.avail_out)
-        {
-            raw_write(z_buffer, zs.next_out - z_buffer);
-            zs.next_out  = z_buffer;
-            zs.avail_out = ZB_SIZE;
-        }
-        // we don't allow Z_BUF_ERROR, so it's fatal for us
-        if (deflate(&zs, Z_NO_FLUSH) != Z_OK)
-            fail("save file compression failed: %s", zs.msg);
-    }
-#else
-    raw_write(data, len);
-#endif
+    encoder->write(data, len);
 }
 
 void chunk_reader::init(plen_t start)
@@ -808,19 +1641,13 @@ void chunk_reader::init(plen_t start)
     first_block = next_block = start;
     block_left = 0;
 
-#ifdef USE_ZLIB
     if (!start)
-        corrupted("save file corrupted -- zlib header missing");
-
-    zs.zalloc    = 0;
-    zs.zfree     = 0;
-    zs.opaque    = Z_NULL;
-    zs.next_in   = Z_NULL;
-    zs.avail_in  = 0;
-    if (inflateInit(&zs))
-        fail("save file decompression failed during init: %s", zs.msg);
-    eof = false;
-#endif
+        corrupted("save file corrupted -- compression header missing");
+
+    decoder = _make_decoder(pkg->codec, [this](void *data, plen_t len)
+                                        {
+                                            return raw_read(data, len);
+                                        });
 }
 
 chunk_reader::chunk_reader(package *parent, plen_t start)
@@ -845,10 +1672,7 @@ chunk_reader::~chunk_reader()
 {
     dprintf("chunk_reader: closing\n");
 
-#ifdef USE_ZLIB
-    if (inflateEnd(&zs) != Z_OK)
-        fail("save file decompression failed during clean-up: %s", zs.msg);
-#endif
+    delete decoder;
     ASSERT(pkg->reader_count[first_block] > 0);
     if (!--pkg->reader_count[first_block])
         pkg->reader_count.erase(first_block);
@@ -867,8 +1691,14 @@ plen_t chunk_reader::raw_read(void *data, plen_t len)
                 return (char*)buf - (char*)data;
 
             block_header bl;
-            pkg->seek(next_block);
-            ssize_t res = ::read(pkg->fd, &bl, sizeof(block_header));
+            ssize_t res;
+            if (pkg->map_data)
+                res = pkg->read_mapped(next_block, &bl, sizeof(block_header));
+            else
+            {
+                pkg->seek(next_block);
+                res = ::read(pkg->fd, &bl, sizeof(block_header));
+            }
             if (res < 0)
                 sysfail("error reading the save file");
             if (res != sizeof(block_header))
@@ -881,13 +1711,14 @@ plen_t chunk_reader::raw_read(void *data, plen_t len)
             if (!block_left)
                 corrupted("save file corrupted -- empty block");
         }
-        else
+        else if (!pkg->map_data)
             pkg->seek(off);
 
         plen_t s = len;
         if (s > block_left)
             s = block_left;
-        ssize_t res = ::read(pkg->fd, buf, s);
+        ssize_t res = pkg->map_data ? pkg->read_mapped(off, buf, s)
+                                    : ::read(pkg->fd, buf, s);
         if (res < 0)
             sysfail("error reading the save file");
         if ((plen_t)res != s)
@@ -908,36 +1739,7 @@ plen_t chunk_reader::read(void *data, plen_t len)
     if (pkg->aborted)
         return 0;
 
-#ifdef USE_ZLIB
-    if (!len)
-        return 0;
-    if (eof)
-        return 0;
-
-    zs.next_out  = (Bytef*)data;
-    zs.avail_out = len;
-    while (zs.avail_out)
-    {
-        if (!zs.avail_in)
-        {
-            zs.next_in  = z_buffer;
-            zs.avail_in = raw_read(z_buffer, sizeof(z_buffer));
-            if (!zs.avail_in)
-                corrupted("save file corrupted -- block truncated");
-        }
-        int res = inflate(&zs, Z_NO_FLUSH);
-        if (res == Z_STREAM_END)
-        {
-            eof = true;
-            return zs.next_out - (Bytef*)data;
-        }
-        if (res != Z_OK)
-            corrupted("save file decompression failed: %s", zs.msg);
-    }
-    return zs.next_out - (Bytef*)data;
-#else
-    return raw_read(data, len);
-#endif
+    return decoder->read(data, len);
 }
 
 void chunk_reader::read_all(vector<char> &data)
@@ -953,3 +1755,25 @@ void chunk_reader::read_all(vector<char> &data)
     data.resize(at + s);
 #undef SPACE
 }
+
+/**
+ * Compress a chunk's contents in memory, producing exactly the bytes a
+ * chunk_writer using the same codec would store for them. This doesn't
+ * touch any package, so it can safely run off the main thread; store the
+ * result with package::write_compressed_chunk().
+ */
+void compress_chunk_data(const vector<unsigned char> &data,
+                         vector<unsigned char> &zdata,
+                         save_codec codec, int level)
+{
+    zdata.clear();
+    unique_ptr<chunk_encoder> enc(_make_encoder(codec, level,
+        [&zdata](const void *out, plen_t len)
+        {
+            const unsigned char *p = static_cast<const unsigned char *>(out);
+            zdata.insert(zdata.end(), p, p + len);
+        }));
+    if (!data.empty())
+        enc->write(&data[0], data.size());
+    enc->finish();
+}
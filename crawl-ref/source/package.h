@@ -2,23 +2,47 @@
 
 #define USE_ZLIB
 
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
-#ifdef USE_ZLIB
-#include <zlib.h>
-#endif
 
 #if !defined(DGAMELAUNCH) && !defined(__ANDROID__) && !defined(DEBUG_DIAGNOSTICS)
 #define DO_FSYNC
 #endif
 
 #define MAX_CHUNK_NAME_LENGTH 255
+// Size of the compression output buffer; data hits the disk in pieces this big.
+#define ZB_SIZE 32768
 
 typedef uint32_t plen_t;
 
+// How a package's chunks are compressed. The value is stored in the file
+// header, so never renumber these.
+enum save_codec
+{
+    SAVE_CODEC_ZLIB,
+    SAVE_CODEC_ZSTD,
+    SAVE_CODEC_LZ4,
+    NUM_SAVE_CODECS
+};
+
+const char *save_codec_name(save_codec codec);
+save_codec save_codec_by_name(const string &name);
+bool save_codec_available(save_codec codec);
+int save_codec_max_level(save_codec codec);
+
+// Uncompressed chunk contents, by name, in the order they are to be stored.
+typedef vector<pair<string, vector<unsigned char> > > chunk_list;
+
 class package;
+class chunk_encoder;
+class chunk_decoder;
 
+// Usually obtained from package::writer(), which first waits for any
+// commit still in flight. The constructor touches the package's user count
+// and codec without waiting, so only construct one directly after
+// package::await_commit().
 class chunk_writer
 {
 private:
@@ -27,14 +51,15 @@ private:
     plen_t first_block;
     plen_t cur_block;
     plen_t block_len;
-#ifdef USE_ZLIB
-    z_stream zs;
-    Bytef *z_buffer;
-#endif
+    bool precompressed;
+    bool closed;
+    chunk_encoder *encoder;
     void raw_write(const void *data, plen_t len);
     void finish_block(plen_t next);
+    void close();
 public:
-    chunk_writer(package *parent, const string &_name);
+    chunk_writer(package *parent, const string &_name,
+                 bool _precompressed = false);
     ~chunk_writer();
     void write(const void *data, plen_t len);
     friend class package;
@@ -43,16 +68,14 @@ public:
 class chunk_reader
 {
 private:
+    // Like chunk_writer's constructor, this doesn't wait for a commit in
+    // flight: only call it after package::await_commit().
     chunk_reader(package *parent, plen_t start);
     void init(plen_t start);
     package *pkg;
     plen_t first_block, next_block;
     plen_t off, block_left;
-#ifdef USE_ZLIB
-    bool eof;
-    z_stream zs;
-    Bytef z_buffer[32768];
-#endif
+    chunk_decoder *decoder;
     plen_t raw_read(void *data, plen_t len);
 public:
     chunk_reader(package *parent, const string &_name);
@@ -70,16 +93,26 @@ public:
     ~package();
     chunk_writer* writer(const string &name);
     chunk_reader* reader(const string &name);
+    void write_compressed_chunk(const string &name,
+                                const vector<unsigned char> &zdata);
     void commit();
+    void commit_async(chunk_list &chunks,
+                      function<void()> on_commit = function<void()>());
+    void await_commit();
     void delete_chunk(const string &name);
+    save_codec get_codec() const { return codec; }
+    int get_codec_level() const { return codec_level; }
+    void set_codec(save_codec new_codec, int level = 0);
     bool has_chunk(const string &name);
     vector<string> list_chunks();
+    void set_fingerprint(const string &name, uint64_t fingerprint);
+    bool get_fingerprint(const string &name, uint64_t &fingerprint) const;
     void abort();
     void unlink();
 
     // statistics
     plen_t get_slack();
-    plen_t get_size() const { return file_len; };
+    plen_t get_size();
     plen_t get_chunk_fragmentation(const string &name);
     plen_t get_chunk_compressed_length(const string &name);
 private:
@@ -90,6 +123,10 @@ private:
     int n_users;
     bool dirty;
     bool aborted;
+    save_codec codec;
+    int codec_level;
+    const unsigned char *map_data;
+    plen_t map_len;
 #ifdef DO_FSYNC
     bool tmp;
 #endif
@@ -99,6 +136,13 @@ private:
     map<plen_t, pair<plen_t, plen_t> > block_map;
     set<plen_t> new_chunks;
     map<plen_t, uint32_t> reader_count;
+    map<string, uint64_t> fingerprints;
+    struct commit_job;
+    commit_job *in_flight;
+    static void *_run_commit(void *arg);
+    void write_chunks(const chunk_list &chunks);
+    void do_commit();
+    void write_commit();
     plen_t extend_block(plen_t at, plen_t size, plen_t by);
     plen_t alloc_block(plen_t &size);
     void finish_chunk(const string &name, plen_t at);
@@ -108,6 +152,9 @@ private:
     void free_block_chain(plen_t at);
     void free_block(plen_t at, plen_t size);
     void seek(plen_t to);
+    void map_file();
+    void unmap_file();
+    ssize_t read_mapped(plen_t at, void *buf, plen_t size);
     void fsck();
     void read_directory(plen_t start, uint8_t version);
     void trace_chunk(plen_t start);
@@ -116,3 +163,7 @@ private:
     friend class chunk_writer;
     friend class chunk_reader;
 };
+
+void compress_chunk_data(const vector<unsigned char> &data,
+                         vector<unsigned char> &zdata,
+                         save_codec codec = SAVE_CODEC_ZLIB, int level = 0);
@@ -9,6 +9,8 @@
 #include "store.h"
 
 #include <algorithm>
+#include <cstring>
+#include <deque>
 
 #include "dlua.h"
 #include "monster.h"
@@ -1202,6 +1204,91 @@ string &CrawlStoreValue::operator += (const string &_val)
     return get_string() += _val;
 }
 
+/////////////////////
+// Interned table keys
+
+namespace
+{
+    // Every key seen so far, by id, and an open-addressed index of their
+    // ids by hash. The names are in a deque so that interning more keys
+    // doesn't move the strings str() handed out.
+    struct key_pool
+    {
+        deque<string> names;
+        vector<uint32_t> slots; // id + 1, or 0 if free
+    };
+}
+
+static key_pool &_key_pool()
+{
+    // Global constructors (the player's, for one) set props, so the pool
+    // must be ready before its own turn to be initialised would come.
+    static key_pool pool;
+    return pool;
+}
+
+static uint32_t _key_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619U;
+    return hash;
+}
+
+static void _grow_key_index(key_pool &pool)
+{
+    vector<uint32_t> slots(max<size_t>(pool.slots.size() * 2, 256), 0);
+    const size_t mask = slots.size() - 1;
+    for (uint32_t id = 0; id < pool.names.size(); ++id)
+    {
+        const string &name = pool.names[id];
+        size_t i = _key_hash(name.data(), name.size()) & mask;
+        while (slots[i])
+            i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+    pool.slots.swap(slots);
+}
+
+static uint32_t _intern_key(const char *name, size_t len)
+{
+    key_pool &pool = _key_pool();
+    // Keep the index at most half full, so probes stay short.
+    if (pool.names.size() * 2 >= pool.slots.size())
+        _grow_key_index(pool);
+
+    const size_t mask = pool.slots.size() - 1;
+    for (size_t i = _key_hash(name, len) & mask;; i = (i + 1) & mask)
+    {
+        const uint32_t slot = pool.slots[i];
+        if (!slot)
+        {
+            pool.names.emplace_back(name, len);
+            pool.slots[i] = pool.names.size();
+            return pool.names.size() - 1;
+        }
+
+        const string &known = pool.names[slot - 1];
+        if (known.size() == len && !memcmp(known.data(), name, len))
+            return slot - 1;
+    }
+}
+
+CrawlHashKey::CrawlHashKey(const string &name)
+    : id(_intern_key(name.data(), name.size()))
+{
+}
+
+CrawlHashKey::CrawlHashKey(const char *name)
+    : id(_intern_key(name, strlen(name)))
+{
+}
+
+const string &CrawlHashKey::str() const
+{
+    return _key_pool().names[id];
+}
+
 //////////////////////////////
 // Read/write from/to savefile
 void CrawlHashTable::write(writer &th) const
@@ -1215,10 +1302,22 @@ void CrawlHashTable::write(writer &th) const
 
     marshallUnsigned(th, size());
 
+    // Keys order by when this run first saw them; marshall the entries by
+    // name instead, so that the same table always gives the same bytes.
+    vector<const value_type *> entries;
+    entries.reserve(size());
     for (const auto &entry : *this)
+        entries.push_back(&entry);
+    sort(entries.begin(), entries.end(),
+         [](const value_type *a, const value_type *b)
+         {
+             return a->first.str() < b->first.str();
+         });
+
+    for (const value_type *entry : entries)
     {
-        marshallString(th, entry.first);
-        entry.second.write(th);
+        marshallString(th, entry->first);
+        entry->second.write(th);
     }
 
     ASSERT_VALIDITY();
@@ -1243,7 +1342,7 @@ void CrawlHashTable::read(reader &th)
     for (unsigned int i = 0; i < _size; i++)
     {
         string           key = unmarshallString(th);
-        CrawlStoreValue &val = (*this)[key];
+        CrawlStoreValue &val = map::operator[](key);
 
         val.read(th);
     }
@@ -1261,7 +1360,7 @@ static map<string, int> accesses;
 //////////////////
 // Misc functions
 
-bool CrawlHashTable::exists(const string &key) const
+bool CrawlHashTable::exists(const CrawlHashKey &key) const
 {
     ACCESS(key);
     ASSERT_VALIDITY();
@@ -1332,7 +1431,7 @@ void CrawlHashTable::assert_validity() const
 ////////////////////////////////
 // Accessors to contained values
 
-CrawlStoreValue& CrawlHashTable::get_value(const string &key)
+CrawlStoreValue& CrawlHashTable::get_value(const CrawlHashKey &key)
 {
     ASSERT_VALIDITY();
     ACCESS(key);
@@ -1340,7 +1439,7 @@ CrawlStoreValue& CrawlHashTable::get_value(const string &key)
     return map::operator[](key);
 }
 
-const CrawlStoreValue& CrawlHashTable::get_value(const string &key) const
+const CrawlStoreValue& CrawlHashTable::get_value(const CrawlHashKey &key) const
 {
     ASSERT_VALIDITY();
     ACCESS(key);
@@ -241,7 +241,36 @@ protected:
     friend class CrawlVector;
 };
 
-class CrawlHashTable : public map<string, CrawlStoreValue>
+// A key of a CrawlHashTable. Each distinct key string is interned once for
+// the whole process, so a key is just a small index and keys compare by
+// that index rather than by their characters. Keys thus sort in the order
+// they were first seen, which differs from run to run; anything that must
+// be stable, like the save, has to order them by name itself.
+//
+// The interned strings are never freed, so don't key tables on anything
+// unbounded.
+class CrawlHashKey
+{
+public:
+    CrawlHashKey(const string &name);
+    CrawlHashKey(const char *name);
+
+    const string &str() const;
+    const char *c_str() const { return str().c_str(); }
+    operator const string &() const { return str(); }
+
+    friend bool operator == (const CrawlHashKey &a, const CrawlHashKey &b)
+    { return a.id == b.id; }
+    friend bool operator != (const CrawlHashKey &a, const CrawlHashKey &b)
+    { return a.id != b.id; }
+    friend bool operator < (const CrawlHashKey &a, const CrawlHashKey &b)
+    { return a.id < b.id; }
+
+private:
+    uint32_t id;
+};
+
+class CrawlHashTable : public map<CrawlHashKey, CrawlStoreValue>
 {
 public:
     friend class CrawlStoreValue;
@@ -249,19 +278,15 @@ public:
     void write(writer &) const;
     void read(reader &);
 
-    bool exists(const string &key) const;
+    bool exists(const CrawlHashKey &key) const;
 
     void assert_validity() const;
 
     // NOTE: If the const versions of get_value() or [] are given a
     // key which doesn't exist, they will assert.
-    const CrawlStoreValue& get_value(const string &key) const;
-    const CrawlStoreValue& get_value(const char *key) const
-    { return get_value(string(key)); }
-    const CrawlStoreValue& operator[] (const string &key) const
+    const CrawlStoreValue& get_value(const CrawlHashKey &key) const;
+    const CrawlStoreValue& operator[] (const CrawlHashKey &key) const
     { return get_value(key); }
-    const CrawlStoreValue& operator[] (const char *key) const
-    { return get_value(string(key)); }
 
     // NOTE: If get_value() or [] is given a key which doesn't exist
     // in the table, an unset/empty CrawlStoreValue will be created
@@ -270,12 +295,9 @@ public:
     // hash table has a type (rather than being heterogeneous)
     // then trying to assign a different type to the CrawlStoreValue
     // will assert.
-    CrawlStoreValue& get_value(const string &key);
-    CrawlStoreValue& get_value(const char *key)
-    { return get_value(string(key)); }
-    using map::operator[];
-    CrawlStoreValue& operator[] (const char *key)
-    { return get_value(string(key)); }
+    CrawlStoreValue& get_value(const CrawlHashKey &key);
+    CrawlStoreValue& operator[] (const CrawlHashKey &key)
+    { return get_value(key); }
 };
 
 // A CrawlVector is the vector version of CrawlHashTable, except that
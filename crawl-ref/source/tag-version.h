@@ -241,6 +241,8 @@ enum tag_minor_version
     TAG_MINOR_MORE_GHOST_MAGIC,    // Update already placed ghosts for positional magic
     TAG_MINOR_DUMMY_AGILITY,       // Convert garbage "agility" potions into stab
     TAG_MINOR_TRACK_REGEN_ITEMS,   // Regen items take effect only after maxhp is reached
+    TAG_MINOR_COLUMNAR_LEVEL,      // Level grids saved a grid at a time, run-length encoded
+    TAG_MINOR_LEVEL_SECTIONS,      // Levels saved as a chunk per section
 #endif
     NUM_TAG_MINORS,
     TAG_MINOR_VERSION = NUM_TAG_MINORS - 1
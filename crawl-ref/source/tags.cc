@@ -105,7 +105,7 @@ extern abyss_state abyssal_state;
 
 reader::reader(const string &_read_filename, int minorVersion)
     : _filename(_read_filename), _chunk(0), _pbuf(nullptr), _read_offset(0),
-      _minorVersion(minorVersion), _safe_read(false)
+      _block_pos(0), _minorVersion(minorVersion), _safe_read(false)
 {
     _file       = fopen_u(_filename.c_str(), "rb");
     opened_file = !!_file;
@@ -113,7 +113,7 @@ reader::reader(const string &_read_filename, int minorVersion)
 
 reader::reader(package *save, const string &chunkname, int minorVersion)
     : _file(0), _chunk(0), opened_file(false), _pbuf(0), _read_offset(0),
-     _minorVersion(minorVersion), _safe_read(false)
+     _block_pos(0), _minorVersion(minorVersion), _safe_read(false)
 {
     ASSERT(save);
     _chunk = new chunk_reader(save, chunkname);
@@ -160,6 +160,16 @@ static NORETURN void _short_read(bool safe_read)
     die_noline("short read while reading save");
 }
 
+// Inflate the next block of a chunk. Returns false at the end of the chunk.
+bool reader::refill_block()
+{
+    ASSERT(_chunk);
+    _block.resize(TAG_IO_BLOCK_SIZE);
+    _block.resize(_chunk->read(&_block[0], TAG_IO_BLOCK_SIZE));
+    _block_pos = 0;
+    return !_block.empty();
+}
+
 // Reads input in network byte order, from a file or buffer.
 unsigned char reader::readByte()
 {
@@ -172,10 +182,9 @@ unsigned char reader::readByte()
     }
     else if (_chunk)
     {
-        unsigned char buf;
-        if (_chunk->read(&buf, 1) != 1)
+        if (_block_pos >= _block.size() && !refill_block())
             _short_read(_safe_read);
-        return buf;
+        return _block[_block_pos++];
     }
     else
     {
@@ -199,8 +208,31 @@ void reader::read(void *data, size_t size)
     }
     else if (_chunk)
     {
-        if (_chunk->read(data, size) != size)
-            _short_read(_safe_read);
+        unsigned char *out = static_cast<unsigned char *>(data);
+        while (size)
+        {
+            if (_block_pos >= _block.size())
+            {
+                // Big reads skip the block and inflate straight into place.
+                if (out && size >= TAG_IO_BLOCK_SIZE)
+                {
+                    if (_chunk->read(out, size) != size)
+                        _short_read(_safe_read);
+                    return;
+                }
+                if (!refill_block())
+                    _short_read(_safe_read);
+            }
+            const size_t n = min(size, _block.size() - _block_pos);
+            // Without anywhere to put it, just skip the data.
+            if (out)
+            {
+                memcpy(out, &_block[_block_pos], n);
+                out += n;
+            }
+            _block_pos += n;
+            size -= n;
+        }
     }
     else
     {
@@ -227,7 +259,7 @@ void reader::setMinorVersion(int minorVersion)
 void reader::fail_if_not_eof(const string &name)
 {
     char dummy;
-    if (_chunk ? _chunk->read(&dummy, 1) :
+    if (_chunk ? _block_pos < _block.size() || _chunk->read(&dummy, 1) :
         _file ? (fgetc(_file) != EOF) :
         _read_offset >= _pbuf->size())
     {
@@ -245,13 +277,36 @@ void writer::check_ok(bool ok)
     }
 }
 
+writer::~writer()
+{
+    if (_chunk)
+    {
+        flush();
+        delete _chunk;
+    }
+}
+
+// Hand any buffered bytes to the package chunk.
+void writer::flush()
+{
+    if (_chunk && !_block.empty())
+    {
+        _chunk->write(&_block[0], _block.size());
+        _block.clear();
+    }
+}
+
 void writer::writeByte(unsigned char ch)
 {
     if (failed)
         return;
 
     if (_chunk)
-        _chunk->write(&ch, 1);
+    {
+        _block.push_back(ch);
+        if (_block.size() >= TAG_IO_BLOCK_SIZE)
+            flush();
+    }
     else if (_file)
         check_ok(fputc(ch, _file) != EOF);
     else
@@ -264,7 +319,18 @@ void writer::write(const void *data, size_t size)
         return;
 
     if (_chunk)
-        _chunk->write(data, size);
+    {
+        if (_block.size() + size < TAG_IO_BLOCK_SIZE)
+        {
+            const unsigned char* cdata = static_cast<const unsigned char*>(data);
+            _block.insert(_block.end(), cdata, cdata + size);
+        }
+        else
+        {
+            flush();
+            _chunk->write(data, size);
+        }
+    }
     else if (_file)
         check_ok(fwrite(data, 1, size, _file) == size);
     else
@@ -337,6 +403,8 @@ static void marshallMonsterInfo (writer &, const monster_info &);
 static void unmarshallMonsterInfo (reader &, monster_info &mi);
 static void marshallMapCell (writer &, const map_cell &);
 static void unmarshallMapCell (reader &, map_cell& cell);
+static void _marshall_map_knowledge(writer &th, const MapKnowledge &map);
+static void _unmarshall_map_knowledge(reader &th, MapKnowledge &map);
 
 template<typename T, typename T_iter, typename T_marshal>
 static void marshall_iterator(writer &th, T_iter beg, T_iter end,
@@ -372,51 +440,129 @@ uint8_t unmarshallUByte(reader &th)
 }
 
 // Marshall 2 byte short in network order.
+static inline void _encode_short(unsigned char *buf, int16_t data)
+{
+    buf[0] = (unsigned char)((data & 0xFF00) >> 8);
+    buf[1] = (unsigned char) (data & 0x00FF);
+}
+
+static inline int16_t _decode_short(const unsigned char *buf)
+{
+    return (int16_t)((buf[0] << 8) | buf[1]);
+}
+
+static inline void _encode_int(unsigned char *buf, int32_t data)
+{
+    buf[0] = (unsigned char)((data & 0xFF000000) >> 24);
+    buf[1] = (unsigned char)((data & 0x00FF0000) >> 16);
+    buf[2] = (unsigned char)((data & 0x0000FF00) >> 8);
+    buf[3] = (unsigned char) (data & 0x000000FF);
+}
+
+static inline int32_t _decode_int(const unsigned char *buf)
+{
+    return (int32_t)(((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16)
+                     | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3]);
+}
+
 void marshallShort(writer &th, short data)
 {
     // TODO: why does this use `short` and `char` when unmarshall uses int16_t??
     CHECK_INITIALIZED(data);
-    const char b2 = (char)(data & 0x00FF);
-    const char b1 = (char)((data & 0xFF00) >> 8);
-    th.writeByte(b1);
-    th.writeByte(b2);
+    unsigned char buf[2];
+    _encode_short(buf, data);
+    th.write(buf, sizeof(buf));
 }
 
 // Unmarshall 2 byte short in network order.
 int16_t unmarshallShort(reader &th)
 {
-    int16_t b1 = th.readByte();
-    int16_t b2 = th.readByte();
-    int16_t data = (b1 << 8) | (b2 & 0x00FF);
-    return data;
+    unsigned char buf[2];
+    th.read(buf, sizeof(buf));
+    return _decode_short(buf);
 }
 
 // Marshall 4 byte int in network order.
 void marshallInt(writer &th, int32_t data)
 {
     CHECK_INITIALIZED(data);
-    char b4 = (char) (data & 0x000000FF);
-    char b3 = (char)((data & 0x0000FF00) >> 8);
-    char b2 = (char)((data & 0x00FF0000) >> 16);
-    char b1 = (char)((data & 0xFF000000) >> 24);
-
-    th.writeByte(b1);
-    th.writeByte(b2);
-    th.writeByte(b3);
-    th.writeByte(b4);
+    unsigned char buf[4];
+    _encode_int(buf, data);
+    th.write(buf, sizeof(buf));
 }
 
 // Unmarshall 4 byte signed int in network order.
 int32_t unmarshallInt(reader &th)
 {
-    int32_t b1 = th.readByte();
-    int32_t b2 = th.readByte();
-    int32_t b3 = th.readByte();
-    int32_t b4 = th.readByte();
+    unsigned char buf[4];
+    th.read(buf, sizeof(buf));
+    return _decode_int(buf);
+}
+
+// Bulk versions of the above: the same bytes as marshalling each value in
+// turn, but encoded a batch at a time.
+#define MARSHALL_BATCH 256
+
+void marshallShorts(writer &th, const int16_t *data, size_t count)
+{
+    unsigned char buf[MARSHALL_BATCH * 2];
+    while (count)
+    {
+        const size_t n = min<size_t>(count, MARSHALL_BATCH);
+        for (size_t i = 0; i < n; ++i)
+        {
+            CHECK_INITIALIZED(data[i]);
+            _encode_short(buf + i * 2, data[i]);
+        }
+        th.write(buf, n * 2);
+        data += n;
+        count -= n;
+    }
+}
 
-    int32_t data = (b1 << 24) | ((b2 & 0x000000FF) << 16);
-    data |= ((b3 & 0x000000FF) << 8) | (b4 & 0x000000FF);
-    return data;
+void unmarshallShorts(reader &th, int16_t *data, size_t count)
+{
+    unsigned char buf[MARSHALL_BATCH * 2];
+    while (count)
+    {
+        const size_t n = min<size_t>(count, MARSHALL_BATCH);
+        th.read(buf, n * 2);
+        for (size_t i = 0; i < n; ++i)
+            data[i] = _decode_short(buf + i * 2);
+        data += n;
+        count -= n;
+    }
+}
+
+void marshallInts(writer &th, const int32_t *data, size_t count)
+{
+    unsigned char buf[MARSHALL_BATCH * 4];
+    while (count)
+    {
+        const size_t n = min<size_t>(count, MARSHALL_BATCH);
+        for (size_t i = 0; i < n; ++i)
+        {
+            CHECK_INITIALIZED(data[i]);
+            _encode_int(buf + i * 4, data[i]);
+        }
+        th.write(buf, n * 4);
+        data += n;
+        count -= n;
+    }
+}
+
+void unmarshallInts(reader &th, int32_t *data, size_t count)
+{
+    unsigned char buf[MARSHALL_BATCH * 4];
+    while (count)
+    {
+        const size_t n = min<size_t>(count, MARSHALL_BATCH);
+        th.read(buf, n * 4);
+        for (size_t i = 0; i < n; ++i)
+            data[i] = _decode_int(buf + i * 4);
+        data += n;
+        count -= n;
+    }
 }
 
 void marshallUnsigned(writer& th, uint64_t v)
@@ -802,6 +948,41 @@ static void _run_length_decode(reader &th, unmarshall um, grid &g,
     }
 }
 
+// Newer level saves store each grid on its own, as runs of equal values,
+// so that long stretches of rock or unexplored cells cost a few bytes.
+// Both lengths and values are varints.
+static void _marshall_grid_runs(writer &th, const vector<uint32_t> &values)
+{
+    size_t i = 0;
+    while (i < values.size())
+    {
+        size_t run = 1;
+        while (i + run < values.size() && values[i + run] == values[i])
+            ++run;
+        marshallUnsigned(th, run);
+        marshallUnsigned(th, values[i]);
+        i += run;
+    }
+}
+
+static void _unmarshall_grid_runs(reader &th, vector<uint32_t> &values,
+                                  size_t count)
+{
+    values.clear();
+    values.reserve(count);
+    while (values.size() < count)
+    {
+        const size_t run = unmarshallUnsigned(th);
+        const uint32_t value = unmarshallUnsigned(th);
+        if (!run || values.size() + run > count)
+        {
+            throw corrupted_save("Level has an invalid run length ("
+                                 + to_string(run) + ")");
+        }
+        values.insert(values.end(), run, value);
+    }
+}
+
 union float_marshall_kludge
 {
     float    f_num;
@@ -1151,6 +1332,46 @@ static void _add_missing_branches()
 
 // Write a tagged chunk of data to the FILE*.
 // tagId specifies what to write.
+// Where each section of the level being marshalled starts, when
+// tag_write_level_sections() wants to know.
+static vector<size_t> *level_section_starts = nullptr;
+
+static void _start_level_section(writer &th)
+{
+    if (level_section_starts)
+        level_section_starts->push_back(th.tell());
+}
+
+static void _construct_level_sections(writer &th)
+{
+    _start_level_section(th);
+    tag_construct_level(th);
+    CANARY;
+    _start_level_section(th);
+    tag_construct_level_items(th);
+    CANARY;
+    _start_level_section(th);
+    tag_construct_level_monsters(th);
+    CANARY;
+    _start_level_section(th);
+    tag_construct_level_tiles(th);
+}
+
+/**
+ * Marshall the current level into data, as the body of a TAG_LEVEL tag,
+ * and note where each of its level_section_types starts. Concatenating the
+ * sections again gives what tag_read(TAG_LEVEL) expects.
+ */
+void tag_write_level_sections(vector<unsigned char> &data,
+                              vector<size_t> &starts)
+{
+    starts.clear();
+    unwind_var<vector<size_t> *> cuts(level_section_starts, &starts);
+    writer th(&data);
+    _construct_level_sections(th);
+    ASSERT(starts.size() == NUM_LEVEL_SECTIONS);
+}
+
 void tag_write(tag_type tagID, writer &outf)
 {
     vector<unsigned char> buf;
@@ -1172,13 +1393,7 @@ void tag_write(tag_type tagID, writer &outf)
         tag_construct_companions(th);
         break;
     case TAG_LEVEL:
-        tag_construct_level(th);
-        CANARY;
-        tag_construct_level_items(th);
-        CANARY;
-        tag_construct_level_monsters(th);
-        CANARY;
-        tag_construct_level_tiles(th);
+        _construct_level_sections(th);
         break;
     case TAG_GHOST:
         tag_construct_ghost(th, global_ghosts);
@@ -1244,6 +1459,8 @@ void tag_read(reader &inf, tag_type tag_id)
 
     // Ok, we have data now.
     reader th(buf, inf.getMinorVersion());
+    // Damage inside the tag is no more fatal than a short tag.
+    th.set_safe_read(inf.safe_read());
     switch (tag_id)
     {
     case TAG_YOU:
@@ -4572,20 +4789,27 @@ static void tag_construct_level(writer &th)
     marshallInt(th, env.turns_on_level);
 
     CANARY;
+    _start_level_section(th);
 
-    for (int count_x = 0; count_x < GXM; count_x++)
-        for (int count_y = 0; count_y < GYM; count_y++)
-        {
-            marshallByte(th, grd[count_x][count_y]);
-            marshallMapCell(th, env.map_knowledge[count_x][count_y]);
-            marshallInt(th, env.pgrid[count_x][count_y].flags);
-        }
+    vector<uint32_t> column;
+    column.reserve(GXM * GYM);
+    for (rectangle_iterator ri(0); ri; ++ri)
+        column.push_back(grd(*ri));
+    _marshall_grid_runs(th, column);
+
+    _start_level_section(th);
+    _marshall_map_knowledge(th, env.map_knowledge);
+
+    _start_level_section(th);
+
+    column.clear();
+    for (rectangle_iterator ri(0); ri; ++ri)
+        column.push_back(env.pgrid(*ri).flags);
+    _marshall_grid_runs(th, column);
 
     marshallBoolean(th, !!env.map_forgotten);
     if (env.map_forgotten)
-        for (int x = 0; x < GXM; x++)
-            for (int y = 0; y < GYM; y++)
-                marshallMapCell(th, (*env.map_forgotten)[x][y]);
+        _marshall_map_knowledge(th, *env.map_forgotten);
 
     _run_length_encode(th, marshallByte, env.grid_colours, GXM, GYM);
 
@@ -4635,8 +4859,11 @@ static void tag_construct_level(writer &th)
     if (env.heightmap)
     {
         grid_heightmap &heightmap(*env.heightmap);
+        vector<int16_t> heights;
+        heights.reserve(GXM * GYM);
         for (rectangle_iterator ri(0); ri; ++ri)
-            marshallShort(th, heightmap(*ri));
+            heights.push_back(heightmap(*ri));
+        marshallShorts(th, heights.data(), heights.size());
     }
 
     CANARY;
@@ -5314,7 +5541,7 @@ void unmarshallItem(reader &th, item_def &item)
 #define MAP_SERIALIZE_CLOUD 0x20
 #define MAP_SERIALIZE_MONSTER 0x40
 
-void marshallMapCell(writer &th, const map_cell &cell)
+static unsigned _map_cell_serialize_flags(const map_cell &cell)
 {
     unsigned flags = 0;
 
@@ -5340,6 +5567,13 @@ void marshallMapCell(writer &th, const map_cell &cell)
     if (cell.monster() != MONS_NO_MONSTER)
         flags |= MAP_SERIALIZE_MONSTER;
 
+    return flags;
+}
+
+void marshallMapCell(writer &th, const map_cell &cell)
+{
+    const unsigned flags = _map_cell_serialize_flags(cell);
+
     marshallUnsigned(th, flags);
 
     switch (flags & MAP_SERIALIZE_FLAGS_MASK)
@@ -5468,6 +5702,53 @@ void unmarshallMapCell(reader &th, map_cell& cell)
     cell.flags = cell_flags;
 }
 
+// Most of a level's map knowledge is empty cells. Save a bitmap of which
+// cells hold anything, followed by just those cells.
+static void _marshall_map_knowledge(writer &th, const MapKnowledge &map)
+{
+    uint8_t bits = 0;
+    int nbits = 0;
+    for (rectangle_iterator ri(0); ri; ++ri)
+    {
+        if (_map_cell_serialize_flags(map(*ri)))
+            bits |= 1 << nbits;
+        if (++nbits == 8)
+        {
+            marshallUByte(th, bits);
+            bits = 0;
+            nbits = 0;
+        }
+    }
+    if (nbits)
+        marshallUByte(th, bits);
+
+    for (rectangle_iterator ri(0); ri; ++ri)
+        if (_map_cell_serialize_flags(map(*ri)))
+            marshallMapCell(th, map(*ri));
+}
+
+static void _unmarshall_map_knowledge(reader &th, MapKnowledge &map)
+{
+    vector<bool> present;
+    present.reserve(GXM * GYM);
+    uint8_t bits = 0;
+    for (int i = 0; i < GXM * GYM; ++i)
+    {
+        if (i % 8 == 0)
+            bits = unmarshallUByte(th);
+        present.push_back(bits & (1 << (i % 8)));
+    }
+
+    int i = 0;
+    for (rectangle_iterator ri(0); ri; ++ri)
+    {
+        if (present[i++])
+            unmarshallMapCell(th, map(*ri));
+        else
+            map(*ri).clear();
+    }
+}
+
 static void tag_construct_level_items(writer &th)
 {
     // how many traps?
@@ -6079,19 +6360,48 @@ static void tag_read_level(reader &th)
 #if TAG_MAJOR_VERSION == 34
     vector<coord_def> transporters;
 #endif
+#if TAG_MAJOR_VERSION == 34
+    if (th.getMinorVersion() < TAG_MINOR_COLUMNAR_LEVEL)
+    {
+        for (int i = 0; i < gx; i++)
+            for (int j = 0; j < gy; j++)
+            {
+                grd[i][j] = unmarshallFeatureType(th);
+                unmarshallMapCell(th, env.map_knowledge[i][j]);
+                env.pgrid[i][j].flags = unmarshallInt(th);
+            }
+    }
+    else
+#endif
+    {
+        vector<uint32_t> column;
+        _unmarshall_grid_runs(th, column, GXM * GYM);
+        int n = 0;
+        for (rectangle_iterator ri(0); ri; ++ri)
+        {
+            grd(*ri) = rewrite_feature(
+                static_cast<dungeon_feature_type>(column[n++]),
+                th.getMinorVersion());
+        }
+
+        _unmarshall_map_knowledge(th, env.map_knowledge);
+
+        _unmarshall_grid_runs(th, column, GXM * GYM);
+        n = 0;
+        for (rectangle_iterator ri(0); ri; ++ri)
+            env.pgrid(*ri).flags = column[n++];
+    }
+
     for (int i = 0; i < gx; i++)
         for (int j = 0; j < gy; j++)
         {
-            dungeon_feature_type feat = unmarshallFeatureType(th);
-            grd[i][j] = feat;
-            ASSERT(feat < NUM_FEATURES);
+            ASSERT(grd[i][j] < NUM_FEATURES);
 
 #if TAG_MAJOR_VERSION == 34
             // Save these for potential destination clean up.
             if (grd[i][j] == DNGN_TRANSPORTER)
                 transporters.push_back(coord_def(i, j));
 #endif
-            unmarshallMapCell(th, env.map_knowledge[i][j]);
             // Fixup positions
             if (env.map_knowledge[i][j].monsterinfo())
                 env.map_knowledge[i][j].monsterinfo()->pos = coord_def(i, j);
@@ -6101,7 +6411,6 @@ static void tag_read_level(reader &th)
             env.map_knowledge[i][j].flags &= ~MAP_VISIBLE_FLAG;
             if (env.map_knowledge[i][j].seen())
                 env.map_seen.set(i, j);
-            env.pgrid[i][j].flags = unmarshallInt(th);
 
             mgrd[i][j] = NON_MONSTER;
         }
@@ -6114,9 +6423,16 @@ static void tag_read_level(reader &th)
     if (unmarshallBoolean(th))
     {
         MapKnowledge *f = new MapKnowledge();
-        for (int x = 0; x < GXM; x++)
-            for (int y = 0; y < GYM; y++)
-                unmarshallMapCell(th, (*f)[x][y]);
+#if TAG_MAJOR_VERSION == 34
+        if (th.getMinorVersion() < TAG_MINOR_COLUMNAR_LEVEL)
+        {
+            for (int x = 0; x < GXM; x++)
+                for (int y = 0; y < GYM; y++)
+                    unmarshallMapCell(th, (*f)[x][y]);
+        }
+        else
+#endif
+        _unmarshall_map_knowledge(th, *f);
         env.map_forgotten.reset(f);
     }
     else
@@ -6253,8 +6569,11 @@ static void tag_read_level(reader &th)
     {
         env.heightmap.reset(new grid_heightmap);
         grid_heightmap &heightmap(*env.heightmap);
+        vector<int16_t> heights(GXM * GYM);
+        unmarshallShorts(th, heights.data(), heights.size());
+        int i = 0;
         for (rectangle_iterator ri(0); ri; ++ri)
-            heightmap(*ri) = unmarshallShort(th);
+            heightmap(*ri) = heights[i++];
     }
 
     EAT_CANARY;
@@ -28,6 +28,25 @@ enum tag_type   // used during save/load process to identify data blocks
     TAG_SKIP
 };
 
+// The parts of a level, in the order tag_write(TAG_LEVEL) marshalls them.
+// Each is saved in a chunk of its own, so that a level left again need
+// only have the parts that changed written out.
+enum level_section_type
+{
+    LEVEL_SECTION_HEADER,               // colours, clocks, dimensions
+    LEVEL_SECTION_TERRAIN,              // the feature grid
+    LEVEL_SECTION_KNOWLEDGE,            // the player's map knowledge
+    LEVEL_SECTION_FEATURES,             // flags, clouds, shops, markers...
+    LEVEL_SECTION_ITEMS,
+    LEVEL_SECTION_MONSTERS,
+    LEVEL_SECTION_TILES,
+    NUM_LEVEL_SECTIONS
+};
+
+// Chunk readers and writers move data to and from the package in blocks
+// of this size.
+#define TAG_IO_BLOCK_SIZE 16384
+
 /* ***********************************************************************
  * writer API
  * *********************************************************************** */
@@ -46,16 +65,18 @@ public:
           _pbuf(poutput), failed(false) { ASSERT(poutput); }
     writer(package *save, const string &chunkname)
         : _filename(), _file(0), _chunk(0), _ignore_errors(false),
-          failed(false)
+          _pbuf(0), failed(false)
     {
         ASSERT(save);
         _chunk = save->writer(chunkname);
+        _block.reserve(TAG_IO_BLOCK_SIZE);
     }
 
-    ~writer() { if (_chunk) delete _chunk; }
+    ~writer();
 
     void writeByte(unsigned char byte);
     void write(const void *data, size_t size);
+    void flush();
     long tell();
 
     bool succeeded() const { return !failed; }
@@ -71,12 +92,18 @@ private:
 
     vector<unsigned char>* _pbuf;
 
+    // Bytes waiting to be handed to _chunk; compressing a byte at a time
+    // is far slower than feeding zlib whole blocks.
+    vector<unsigned char> _block;
+
     bool failed;
 };
 
 void marshallByte    (writer &, int8_t);
 void marshallShort   (writer &, int16_t);
 void marshallInt     (writer &, int32_t);
+void marshallShorts  (writer &, const int16_t *data, size_t count);
+void marshallInts    (writer &, const int32_t *data, size_t count);
 void marshallFloat   (writer &, float);
 void marshallUByte   (writer &, uint8_t);
 void marshallBoolean (writer &, bool);
@@ -99,11 +126,13 @@ public:
     reader(const string &filename, int minorVersion = TAG_MINOR_INVALID);
     reader(FILE* input, int minorVersion = TAG_MINOR_INVALID)
         : _file(input), _chunk(0), opened_file(false), _pbuf(0),
-          _read_offset(0), _minorVersion(minorVersion), _safe_read(false) {}
+          _read_offset(0), _block_pos(0), _minorVersion(minorVersion),
+          _safe_read(false) {}
     reader(const vector<unsigned char>& input,
            int minorVersion = TAG_MINOR_INVALID)
         : _file(0), _chunk(0), opened_file(false), _pbuf(&input),
-          _read_offset(0), _minorVersion(minorVersion), _safe_read(false) {}
+          _read_offset(0), _block_pos(0), _minorVersion(minorVersion),
+          _safe_read(false) {}
     reader(package *save, const string &chunkname,
            int minorVersion = TAG_MINOR_INVALID);
     ~reader();
@@ -120,6 +149,10 @@ public:
     string filename() const { return _filename; }
 
     void set_safe_read(bool setting) { _safe_read = setting; }
+    bool safe_read() const { return _safe_read; }
+
+private:
+    bool refill_block();
 
 private:
     string _filename;
@@ -128,6 +161,9 @@ private:
     bool  opened_file;
     const vector<unsigned char>* _pbuf;
     unsigned int _read_offset;
+    // Data inflated from _chunk ahead of the caller.
+    vector<unsigned char> _block;
+    size_t _block_pos;
     int _minorVersion;
     // always throw an exception rather than dying when reading past EOF
     bool _safe_read;
@@ -138,6 +174,8 @@ class short_read_exception : exception {};
 int8_t      unmarshallByte    (reader &);
 int16_t     unmarshallShort   (reader &);
 int32_t     unmarshallInt     (reader &);
+void        unmarshallShorts  (reader &, int16_t *data, size_t count);
+void        unmarshallInts    (reader &, int32_t *data, size_t count);
 float       unmarshallFloat   (reader &);
 uint8_t     unmarshallUByte   (reader &);
 bool        unmarshallBoolean (reader &);
@@ -169,6 +207,8 @@ static inline void unmarshallSigned(reader& th, T& v)
 
 void tag_read(reader &inf, tag_type tag_id);
 void tag_write(tag_type tagID, writer &outf);
+void tag_write_level_sections(vector<unsigned char> &data,
+                              vector<size_t> &starts);
 void tag_read_char(reader &th, uint8_t format, uint8_t major, uint8_t minor);
 
 vector<ghost_demon> tag_read_ghosts(reader &th);
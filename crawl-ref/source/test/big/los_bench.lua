@@ -0,0 +1,49 @@
+-- Time the bitset LOS kernel against the scalar one on the debug_los maps,
+-- checking that they agree everywhere, and the ways of invalidating the LOS
+-- cache against each other.
+
+local iterations = 20
+
+local bitset_total, scalar_total = 0, 0
+-- Invalidation time per changed cell, by how many cells around the player
+-- are looking: the player alone, then a 3x3 and a 7x7 crowd.
+local radii = { 0, 1, 3 }
+local invalidate = { }
+for _, r in ipairs(radii) do
+  invalidate[r] = { block = 0, shadows = 0, auto = 0 }
+end
+
+local function bench_los_map(map)
+  dgn.reset_level()
+  dgn.tags(map, "no_rotate no_vmirror no_hmirror no_pool_fixup")
+  local function place_map()
+    return dgn.place_map(map, true, true)
+  end
+  dgn.with_map_anchors(30, 30, place_map)
+  you.moveto(30, 30)
+  local bitset, scalar = debug.los_benchmark(iterations)
+  bitset_total = bitset_total + bitset
+  scalar_total = scalar_total + scalar
+  for _, r in ipairs(radii) do
+    local block, shadows, auto = debug.los_invalidate_benchmark(iterations, r)
+    invalidate[r].block = invalidate[r].block + block
+    invalidate[r].shadows = invalidate[r].shadows + shadows
+    invalidate[r].auto = invalidate[r].auto + auto
+  end
+end
+
+local map = dgn.map_by_tag("debug_los")
+assert(map, "Could not find debug-los maps (tag 'debug_los')")
+while map do
+  bench_los_map(map)
+  map = dgn.map_by_tag("debug_los")
+end
+
+crawl.stderr("LOS benchmark: bitset " .. bitset_total .. "ms, scalar "
+             .. scalar_total .. "ms\n")
+for _, r in ipairs(radii) do
+  crawl.stderr("LOS invalidation, radius " .. r .. ": block "
+               .. invalidate[r].block .. "us, shadows "
+               .. invalidate[r].shadows .. "us, auto "
+               .. invalidate[r].auto .. "us\n")
+end
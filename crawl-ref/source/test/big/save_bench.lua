@@ -0,0 +1,65 @@
+-- Time marshalling the player, levels at several depths and ghosts, report
+-- how well each compresses, and read back damaged copies of the levels and
+-- ghosts to exercise the safe-read paths.
+
+local iterations = 10
+local fuzz_iterations = 200
+local fuzz_seed = 1
+
+-- Places to generate, with an experience level fitting for each.
+local places = {
+  { "D:1", 1 },
+  { "D:6", 8 },
+  { "D:12", 14 },
+  { "Depths:3", 20 },
+  { "Zot:5", 27 },
+}
+
+local tags = { "you", "level", "ghost" }
+-- The player is only written, never read back.
+local read_tags = { "level", "ghost" }
+local codecs = { "zlib", "zstd", "lz4" }
+
+local function kb_per_s(bytes, ms)
+  if not ms or ms <= 0 then
+    return "-"
+  end
+  return string.format("%.0f", bytes * iterations / ms * 1000 / 1024)
+end
+
+local function report(place, name, r)
+  local line = string.format("%-9s %-6s %8d bytes, write %s KB/s, read %s KB/s",
+                             place, name, r.bytes, kb_per_s(r.bytes, r.write_ms),
+                             kb_per_s(r.bytes, r.read_ms))
+  for _, codec in ipairs(codecs) do
+    if r[codec] then
+      line = line .. string.format(", %s %d (%s KB/s)", codec, r[codec],
+                                   kb_per_s(r.bytes, r[codec .. "_ms"]))
+    end
+  end
+  crawl.stderr(line .. "\n")
+end
+
+for _, p in ipairs(places) do
+  local place, xl = p[1], p[2]
+  you.set_xl(xl)
+  debug.flush_map_memory()
+  debug.goto_place(place)
+  debug.generate_level()
+
+  local results = debug.save_benchmark(iterations)
+  for _, name in ipairs(tags) do
+    report(place, name, results[name])
+  end
+
+  for _, name in ipairs(read_tags) do
+    assert(results[name].roundtrip,
+           name .. " at " .. place .. " changed after a write and read")
+    local ok, short, failed = debug.save_fuzz(name, fuzz_iterations, fuzz_seed)
+    crawl.stderr(string.format("%-9s %-6s fuzz (seed %d): %d read, "
+                               .. "%d short, %d rejected\n", place, name,
+                               fuzz_seed, ok, short, failed))
+  end
+end
+
+you.set_xl(1)
@@ -0,0 +1,33 @@
+-- Time building everything a newly joined webtiles spectator is sent, on
+-- fully mapped levels at several depths. Only webtiles builds can run this.
+
+if not debug.webtiles_benchmark then
+  crawl.stderr("webtiles_bench: not a webtiles build, skipping\n")
+  return
+end
+
+local iterations = 20
+
+-- Places to generate, with an experience level fitting for each.
+local places = {
+  { "D:1", 1 },
+  { "D:12", 14 },
+  { "Depths:3", 20 },
+  { "Zot:5", 27 },
+}
+
+for _, p in ipairs(places) do
+  local place, xl = p[1], p[2]
+  you.set_xl(xl)
+  debug.flush_map_memory()
+  debug.goto_place(place)
+  debug.generate_level()
+
+  local ms, bytes = debug.webtiles_benchmark(iterations, true)
+  crawl.stderr(string.format("%-9s %8d bytes, %.2f ms per spectator, "
+                             .. "%.0f KB/s\n", place, bytes / iterations,
+                             ms / iterations,
+                             ms > 0 and bytes / ms * 1000 / 1024 or 0))
+end
+
+you.set_xl(1)
@@ -5,6 +5,7 @@
 #include "tileweb.h"
 
 #include <cerrno>
+#include <chrono>
 #include <cstdarg>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -61,6 +62,30 @@
 
 //#define DEBUG_WEBSOCKETS
 
+// How much a spectating receiver may have queued, in bytes, and for how long
+// (in milliseconds) it may refuse data, before we stop sending it updates.
+#define RECEIVER_MAX_QUEUED (1024 * 1024)
+#define RECEIVER_MAX_STALL 2000
+// How long a receiver that fell behind is left alone before it is sent
+// everything again.
+#define RECEIVER_RESYNC_DELAY 1000
+// How long to wait for the player's own receiver to take its data before
+// giving up on it, and how much it may have queued before we start to.
+#define PRIMARY_MAX_QUEUED (8 * 1024 * 1024)
+#define PRIMARY_MAX_STALL 60000
+// How often to retry sends while waiting for input.
+#define RECEIVER_RETRY_INTERVAL 20
+
+// How many dirty cells outside the client's view go with each map update,
+// if the minimap shows them, and with each batch sent while waiting for
+// input. The rest wait for later batches.
+#define MAP_OFFSCREEN_BATCH 400
+// How long to wait between those batches, in milliseconds.
+#define MAP_BATCH_INTERVAL 10
+// How far outside the client's view cells still count as in it, so that
+// scrolling a little doesn't show stale ones.
+#define CLIENT_VIEW_MARGIN 2
+
 static unsigned int get_milliseconds()
 {
     // This is Unix-only, but so is Webtiles at the moment.
@@ -73,6 +98,8 @@ static unsigned int get_milliseconds()
 TilesFramework tiles;
 
 TilesFramework::TilesFramework() :
+      m_msg_bytes(0),
+      m_resyncing(false),
       m_controlled_from_web(false),
       _send_lock(false),
       m_last_ui_state(UI_INIT),
@@ -84,6 +111,10 @@ TilesFramework::TilesFramework() :
       m_current_flash_colour(BLACK),
       m_next_flash_colour(BLACK),
       m_need_full_map(true),
+      m_packed_cells(false),
+      m_client_view_known(false),
+      m_client_minimap(true),
+      m_deferred_cells(0),
       m_text_menu("menu_txt"),
       m_print_fg(15)
 {
@@ -91,6 +122,10 @@ TilesFramework::TilesFramework() :
     default_cell.tile.bg = TILE_FLAG_UNSEEN;
     m_current_view.fill(default_cell);
     m_next_view.fill(default_cell);
+
+    // Messages are built in place here, and clearing it keeps the capacity,
+    // so it should hardly ever have to grow.
+    m_msg_buf.reserve(64 * 1024);
 }
 
 TilesFramework::~TilesFramework()
@@ -102,6 +137,10 @@ void TilesFramework::shutdown()
     if (m_sock_name.empty())
         return;
 
+    // Give the receivers a chance to take the last messages, such as the
+    // reason for exiting.
+    _drain_queued(PRIMARY_MAX_STALL);
+
     close(m_sock);
     remove(m_sock_name.c_str());
 }
@@ -173,16 +212,17 @@ void TilesFramework::write_message(const char *format, ...)
         die("Webtiles message too long! (%d)", len);
     va_end(argp);
 
-    m_msg_buf.append(buf);
+    m_msg_buf.append(buf, len);
 }
 
 void TilesFramework::finish_message()
 {
     if (m_msg_buf.size() == 0)
         return;
+    m_msg_bytes += m_msg_buf.size();
 #ifdef DEBUG_WEBSOCKETS
     const int initial_buf_size = m_msg_buf.size();
-    fprintf(stderr, "websocket: About to send %d bytes.\n", initial_buf_size);
+    fprintf(stderr, "websocket: About to queue %d bytes.\n", initial_buf_size);
 #endif
 
     if (m_sock_name.empty())
@@ -202,72 +242,208 @@ void TilesFramework::finish_message()
             fragment_size = m_max_msg_size;
         fragments++;
 
-        for (unsigned int i = 0; i < m_dest_addrs.size(); ++i)
-        {
-            int retries = 30;
-            ssize_t sent = 0;
-            while (sent < fragment_size)
+        // Receivers that fell behind get nothing until their resync, which
+        // sends only to them.
+        for (Receiver &receiver : m_receivers)
+            if (receiver.behind == m_resyncing)
             {
-                ssize_t retval = sendto(m_sock, fragment_start + sent,
-                    fragment_size - sent, 0, (sockaddr*) &m_dest_addrs[i],
-                    sizeof(sockaddr_un));
-#ifdef DEBUG_WEBSOCKETS
-                fprintf(stderr,
-                            "    trying to send fragment to client %d...", i);
-#endif
-                if (retval <= 0)
-                {
-                    const char *errmsg = retval == 0 ? "No bytes sent"
-                                                     : strerror(errno);
-                    if (--retries <= 0)
-                        die("Socket write error: %s", errmsg);
+                receiver.fragments.emplace_back(fragment_start, fragment_size);
+                receiver.queued += fragment_size;
+            }
 
-                    if (retval == 0 || errno == ENOBUFS || errno == EWOULDBLOCK
-                        || errno == EINTR || errno == EAGAIN)
-                    {
-                        // Wait for half a second at first (up to five), then
-                        // try again.
-                        const int sleep_time = retries > 25 ? 2 * 1000
-                                             : retries > 10 ? 500 * 1000
-                                             : 5000 * 1000;
+        fragment_start += fragment_size;
+    }
+    m_msg_buf.clear();
+    m_need_flush = true;
 #ifdef DEBUG_WEBSOCKETS
-                        fprintf(stderr, "failed (%s), sleeping for %dms.\n",
-                                                    errmsg, sleep_time / 1000);
+    fprintf(stderr, "websocket: Queued %d bytes in %d fragments.\n",
+                                                initial_buf_size, fragments);
 #endif
-                        usleep(sleep_time);
-                    }
-                    else if (errno == ECONNREFUSED || errno == ENOENT)
-                    {
-                        // the other side is dead
+
+    _send_queued();
+
+    // The player's own receiver is never dropped, so if it gets this far
+    // behind, wait for it.
+    bool overfull = false;
+    for (const Receiver &receiver : m_receivers)
+        if (receiver.primary && receiver.queued > PRIMARY_MAX_QUEUED)
+            overfull = true;
+    if (overfull && !_drain_queued(PRIMARY_MAX_STALL))
+        die("Socket write error: the game's receiver stopped reading");
+}
+
+/**
+ * Send each receiver as much of its queue as it will take without blocking.
+ * A spectating receiver that can't keep up has its queue dropped.
+ *
+ * @return whether everything owed to receivers that are keeping up has
+ *         been sent.
+ */
+bool TilesFramework::_send_queued()
+{
+    bool done = true;
+    for (unsigned int i = 0; i < m_receivers.size(); ++i)
+    {
+        Receiver &receiver = m_receivers[i];
+        bool detached = false;
+        while (!receiver.fragments.empty())
+        {
+            const string &fragment = receiver.fragments.front();
+            // Datagrams go whole or not at all.
+            ssize_t retval = sendto(m_sock, fragment.data(), fragment.size(),
+                                    MSG_DONTWAIT,
+                                    (sockaddr*) &receiver.addr,
+                                    sizeof(sockaddr_un));
+            if (retval > 0)
+            {
+                receiver.mid_message = fragment.back() != '\n';
+                receiver.queued -= fragment.size();
+                receiver.fragments.pop_front();
+                receiver.stalled = false;
+                continue;
+            }
+
+            if (retval < 0 && errno == EINTR)
+                continue;
+            if (retval == 0 || errno == ENOBUFS || errno == EWOULDBLOCK
+                || errno == EAGAIN)
+            {
 #ifdef DEBUG_WEBSOCKETS
-                        fprintf(stderr,
-                            "failed (%s), breaking.\n", errmsg);
+                fprintf(stderr, "websocket: receiver %d is full, %d bytes "
+                                "queued.\n", i, (int) receiver.queued);
 #endif
-                        m_dest_addrs.erase(m_dest_addrs.begin() + i);
-                        i--;
-                        break;
-                    }
-                    else
-                        die("Socket write error: %s", errmsg);
-                }
-                else
+                if (!receiver.stalled)
                 {
+                    receiver.stalled = true;
+                    receiver.stalled_since = get_milliseconds();
+                }
+                break;
+            }
+            else if (errno == ECONNREFUSED || errno == ENOENT)
+            {
+                // the other side is dead
 #ifdef DEBUG_WEBSOCKETS
-                    fprintf(stderr, "fragment size %d sent.\n", fragment_size);
+                fprintf(stderr, "websocket: receiver %d is gone (%s).\n",
+                                i, strerror(errno));
 #endif
-                    sent += retval;
-                }
+                detached = true;
+                break;
             }
+            else
+                die("Socket write error: %s", strerror(errno));
         }
 
-        fragment_start += fragment_size;
+        if (detached)
+        {
+            m_receivers.erase(m_receivers.begin() + i);
+            i--;
+            continue;
+        }
+
+        if (!receiver.primary && !receiver.behind
+            && (receiver.queued > RECEIVER_MAX_QUEUED
+                || (receiver.stalled
+                    && get_milliseconds() - receiver.stalled_since
+                       > RECEIVER_MAX_STALL)))
+        {
+            _drop_queued(receiver);
+        }
+
+        if (!receiver.behind && !receiver.fragments.empty())
+            done = false;
     }
-    m_msg_buf.clear();
-    m_need_flush = true;
+    return done;
+}
+
+/**
+ * Stop sending updates to a receiver that isn't keeping up. What's queued
+ * for it is thrown away, except for the rest of any message it has been
+ * sent part of, and it is marked as needing a resync.
+ */
+void TilesFramework::_drop_queued(Receiver &receiver)
+{
+    auto keep = receiver.fragments.begin();
+    if (receiver.mid_message)
+    {
+        while (keep != receiver.fragments.end() && keep->back() != '\n')
+            ++keep;
+        if (keep != receiver.fragments.end())
+            ++keep;
+    }
+    for (auto it = keep; it != receiver.fragments.end(); ++it)
+        receiver.queued -= it->size();
+    receiver.fragments.erase(keep, receiver.fragments.end());
+
 #ifdef DEBUG_WEBSOCKETS
-    fprintf(stderr, "websocket: Sent %d bytes in %d fragments.\n",
-                                                initial_buf_size, fragments);
+    fprintf(stderr, "websocket: dropping a receiver's updates until it "
+                    "catches up.\n");
 #endif
+    receiver.behind = true;
+    receiver.behind_since = get_milliseconds();
+}
+
+/**
+ * Keep sending until the receivers that are keeping up have everything,
+ * or timeout milliseconds pass.
+ *
+ * @return whether they got everything.
+ */
+bool TilesFramework::_drain_queued(unsigned int timeout)
+{
+    const unsigned int start = get_milliseconds();
+    while (!_send_queued())
+    {
+        if (get_milliseconds() - start > timeout)
+            return false;
+        usleep(RECEIVER_RETRY_INTERVAL * 1000);
+    }
+    return true;
+}
+
+/**
+ * Send everything again to the receivers that fell behind, once they have
+ * taken what was left queued for them and had a moment's rest. This is in
+ * place of all the updates they missed.
+ */
+void TilesFramework::_resync_receivers()
+{
+    if (_send_lock)
+        return;
+
+    bool ready = false;
+    for (const Receiver &receiver : m_receivers)
+    {
+        if (receiver.behind && receiver.fragments.empty()
+            && get_milliseconds() - receiver.behind_since
+               > RECEIVER_RESYNC_DELAY)
+        {
+            ready = true;
+        }
+    }
+    if (!ready)
+        return;
+
+    // Bring everyone else up to date first: sending everything marks the
+    // map as sent, and pending changes mustn't get lost to them.
+    set_need_redraw();
+    redraw();
+    // That includes map cells still held back from them, since the resync
+    // marks those as sent too.
+    while (m_deferred_cells)
+        _send_map(false, true);
+    flush_messages();
+
+    {
+        unwind_bool resyncing(m_resyncing, true);
+        _send_everything();
+        flush_messages();
+    }
+
+    for (Receiver &receiver : m_receivers)
+    {
+        receiver.behind = false;
+        receiver.stalled = false;
+    }
 }
 
 void TilesFramework::send_message(const char *format, ...)
@@ -287,7 +463,7 @@ void TilesFramework::send_message(const char *format, ...)
     }
     va_end(argp);
 
-    m_msg_buf.append(buf);
+    m_msg_buf.append(buf, len);
 
     finish_message();
 }
@@ -310,7 +486,7 @@ void TilesFramework::_await_connection()
     if (m_sock_name.empty())
         return;
 
-    while (m_dest_addrs.size() == 0)
+    while (m_receivers.empty())
         _receive_control_message();
 }
 
@@ -363,8 +539,12 @@ wint_t TilesFramework::_handle_control_message(sockaddr_un addr, string data)
         JsonWrapper primary = json_find_member(obj.node, "primary");
         primary.check(JSON_BOOL);
 
-        m_dest_addrs.push_back(addr);
+        m_receivers.emplace_back(addr, primary->bool_);
         m_controlled_from_web = primary->bool_;
+        // A new player's client may not read packed cells; it asks for them
+        // again if it can.
+        if (primary->bool_)
+            m_packed_cells = false;
     }
     else if (msgtype == "key")
     {
@@ -456,15 +636,41 @@ wint_t TilesFramework::_handle_control_message(sockaddr_un addr, string data)
     }
     else if (msgtype == "ui_state_sync")
         ui::recv_ui_state_change(obj.node);
+    else if (msgtype == "map_format")
+    {
+        JsonWrapper format = json_find_member(obj.node, "format");
+        format.check(JSON_STRING);
+        m_packed_cells = string(format->string_) == "packed";
+    }
+    else if (msgtype == "viewport")
+    {
+        JsonWrapper x = json_find_member(obj.node, "x");
+        JsonWrapper y = json_find_member(obj.node, "y");
+        JsonWrapper cols = json_find_member(obj.node, "cols");
+        JsonWrapper rows = json_find_member(obj.node, "rows");
+        JsonWrapper minimap = json_find_member(obj.node, "minimap");
+        x.check(JSON_NUMBER);
+        y.check(JSON_NUMBER);
+        cols.check(JSON_NUMBER);
+        rows.check(JSON_NUMBER);
+        minimap.check(JSON_BOOL);
+
+        m_client_view_tl = coord_def((int)x->number_, (int)y->number_);
+        m_client_view_size = coord_def((int)cols->number_,
+                                       (int)rows->number_);
+        m_client_view_known = !m_origin.equals(-1, -1);
+        m_client_minimap = minimap->bool_;
+    }
 
     return c;
 }
 
-bool TilesFramework::await_input(wint_t& c, bool block)
+bool TilesFramework::await_input(wint_t& c, bool block, int timeout_ms)
 {
     int result;
     fd_set fds;
     int maxfd = m_sock_name.empty() ? STDIN_FILENO : m_sock;
+    const unsigned int start = get_milliseconds();
 
     while (true)
     {
@@ -478,7 +684,37 @@ bool TilesFramework::await_input(wint_t& c, bool block)
             if (block)
             {
                 tiles.flush_messages();
-                result = select(maxfd + 1, &fds, nullptr, nullptr, nullptr);
+                _resync_receivers();
+
+                // While any receiver is still owed data, wake up now and
+                // then to send it more.
+                bool owed = !_send_queued();
+
+                // Map cells the client isn't showing go out a batch at a
+                // time, once everything before them has been taken.
+                if (!owed && m_deferred_cells && m_view_loaded)
+                {
+                    _send_map(false, true);
+                    flush_messages();
+                    owed = !_send_queued();
+                }
+
+                for (const Receiver &receiver : m_receivers)
+                    owed = owed || receiver.behind;
+                int wait = owed ? RECEIVER_RETRY_INTERVAL
+                                : m_deferred_cells ? MAP_BATCH_INTERVAL : -1;
+                if (timeout_ms >= 0)
+                {
+                    const int left = max(0, timeout_ms
+                                 - (int) (get_milliseconds() - start));
+                    wait = wait < 0 ? left : min(wait, left);
+                }
+                timeval retry;
+                retry.tv_sec = wait / 1000;
+                retry.tv_usec = wait % 1000 * 1000;
+
+                result = select(maxfd + 1, &fds, nullptr, nullptr,
+                                wait >= 0 ? &retry : nullptr);
             }
             else
             {
@@ -492,7 +728,15 @@ bool TilesFramework::await_input(wint_t& c, bool block)
         while (result == -1 && errno == EINTR);
 
         if (result == 0)
+        {
+            if (block && (timeout_ms < 0
+                          || get_milliseconds() - start
+                             < (unsigned int) timeout_ms))
+            {
+                continue;
+            }
             return false;
+        }
         else if (result > 0)
         {
             if (!m_sock_name.empty() && FD_ISSET(m_sock, &fds))
@@ -564,8 +808,10 @@ void TilesFramework::_send_version()
     send_message("*{\"msg\":\"client_path\",\"path\":\"%s\",\"version\":\"%s\"}", WEB_DIR_PATH, Version::Long);
 #endif
 
+    // Clients that can read packed map cells ask for them in reply.
     string title = CRAWL " " + string(Version::Long);
-    send_message("{\"msg\":\"version\",\"text\":\"%s\"}", title.c_str());
+    send_message("{\"msg\":\"version\",\"text\":\"%s\","
+                 "\"map_formats\":[\"json\",\"packed\"]}", title.c_str());
 }
 
 void TilesFramework::_send_options()
@@ -782,7 +1028,7 @@ void TilesFramework::update_input_mode(mouse_mode mode)
 
 static bool _update_string(bool force, string& current,
                            const string& next,
-                           const string& name,
+                           const char *name,
                            bool update = true)
 {
     if (force || current != next)
@@ -797,7 +1043,7 @@ static bool _update_string(bool force, string& current,
 }
 
 template<class T> static bool _update_int(bool force, T& current, T next,
-                                          const string& name,
+                                          const char *name,
                                           bool update = true)
 {
     if (force || current != next)
@@ -1050,7 +1296,7 @@ void TilesFramework::_send_player(bool force_full)
     for (unsigned int i = EQ_FIRST_EQUIP; i < NUM_EQUIP; ++i)
     {
         const int8_t equip = !you.melded[i] ? you.equip[i] : -1;
-        _update_int(force_full, c.equip[i], equip, to_string(i));
+        _update_int(force_full, c.equip[i], equip, to_string(i).c_str());
     }
     json_close_object(true);
 
@@ -1297,15 +1543,156 @@ static inline unsigned _get_brand(int col)
                                             : unsigned{CHATTR_NORMAL};
 }
 
+// The fields of a cell in a packed map message, each present if its bit is
+// set in the cell's mask, in this order. Keep in step with merge_packed()
+// in map_knowledge.js.
+enum packed_cell_field
+{
+    PCF_FEAT           = 1 << 0,
+    PCF_MAP_FEAT       = 1 << 1,
+    PCF_GLYPH          = 1 << 2,
+    PCF_COLOUR         = 1 << 3,
+    PCF_FG             = 1 << 4,
+    PCF_BASE           = 1 << 5,
+    PCF_BG             = 1 << 6,
+    PCF_CLOUD          = 1 << 7,
+    PCF_FLAGS          = 1 << 8,
+    PCF_HALO           = 1 << 9,
+    PCF_ORB_GLOW       = 1 << 10,
+    PCF_BLOOD_ROTATION = 1 << 11,
+    PCF_TRAVEL_TRAIL   = 1 << 12,
+    PCF_FLAVOUR        = 1 << 13,
+    PCF_OVERLAYS       = 1 << 14,
+};
+
+static void _pack_varint(string &out, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        out += (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += (char) value;
+}
+
+// Signed values are zigzagged, so that small negatives stay short.
+static void _pack_int(string &out, int value)
+{
+    _pack_varint(out, ((uint32_t) value << 1) ^ (uint32_t) (value >> 31));
+}
+
+static void _pack_tileidx(string &out, tileidx_t t)
+{
+    _pack_varint(out, t & 0xFFFFFFFF);
+    _pack_varint(out, t >> 32);
+}
+
+/*
+  The cells of a packed map message, base64-encoded so that they can travel
+  inside the JSON. The frame starts with the client coordinates of the map's
+  top left corner and the map's width. Each record then gives the number of
+  cells skipped since the last one in row-major order, the number of
+  following cells that are just the same, and the cell itself: a mask of
+  packed_cell_fields followed by those fields.
+ */
+class cell_packer
+{
+public:
+    cell_packer() : last(-1), pending_skip(0), repeats(0) {}
+
+    void add(const coord_def &origin, const coord_def &gc,
+             const string &cell)
+    {
+        const int index = gc.y * GXM + gc.x;
+        if (data.empty())
+        {
+            _pack_int(data, -origin.x);
+            _pack_int(data, -origin.y);
+            _pack_varint(data, GXM);
+        }
+        else if (index == last + 1 && cell == pending)
+        {
+            ++repeats;
+            last = index;
+            return;
+        }
+
+        _flush();
+        pending = cell;
+        pending_skip = index - last - 1;
+        repeats = 0;
+        last = index;
+    }
+
+    bool empty() const { return data.empty(); }
+
+    string base64()
+    {
+        _flush();
+
+        static const char digits[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        string out;
+        out.reserve((data.size() + 2) / 3 * 4);
+        for (size_t i = 0; i < data.size(); i += 3)
+        {
+            uint32_t n = (uint8_t) data[i] << 16;
+            if (i + 1 < data.size())
+                n |= (uint8_t) data[i + 1] << 8;
+            if (i + 2 < data.size())
+                n |= (uint8_t) data[i + 2];
+            out += digits[n >> 18 & 63];
+            out += digits[n >> 12 & 63];
+            out += i + 1 < data.size() ? digits[n >> 6 & 63] : '=';
+            out += i + 2 < data.size() ? digits[n & 63] : '=';
+        }
+        return out;
+    }
+
+private:
+    void _flush()
+    {
+        if (pending.empty())
+            return;
+        _pack_varint(data, pending_skip);
+        _pack_varint(data, repeats);
+        data += pending;
+        pending.clear();
+    }
+
+    string data;
+    string pending;
+    int last;
+    int pending_skip;
+    int repeats;
+};
+
+// Whether a cell can be packed. Monsters, dolls and the player need the
+// nested objects that only _send_cell() writes.
+static bool _can_pack_cell(const screen_cell_t &next_sc,
+                           const map_cell &current_mc,
+                           const map_cell &next_mc)
+{
+    if (current_mc.monsterinfo() || next_mc.monsterinfo())
+        return false;
+    return (next_sc.tile.fg & TILE_FLAG_MASK) < TILE_MAIN_MAX;
+}
+
 void TilesFramework::write_tileidx(tileidx_t t)
 {
     // JS can only handle signed ints
     const int lo = t & 0xFFFFFFFF;
     const int hi = t >> 32;
     if (hi == 0)
-        tiles.write_message("%d", lo);
+        _write_int(lo);
     else
-        tiles.write_message("[%d,%d]", lo, hi);
+    {
+        m_msg_buf += '[';
+        _write_int(lo);
+        m_msg_buf += ',';
+        _write_int(hi);
+        m_msg_buf += ']';
+    }
 }
 
 void TilesFramework::_send_cell(const coord_def &gc,
@@ -1535,6 +1922,171 @@ void TilesFramework::_send_cell(const coord_def &gc,
     json_close_object(true);
 }
 
+/**
+ * Pack the changes to a cell that _send_cell() would otherwise write as
+ * JSON, for a cell that _can_pack_cell().
+ *
+ * @param[out] fields the packed cell. Reused from cell to cell, so that it
+ *                    needn't be reallocated.
+ * @return whether anything changed.
+ */
+static bool _pack_cell(string &fields, const coord_def &gc,
+                         const screen_cell_t &current_sc,
+                         const screen_cell_t &next_sc,
+                         const map_cell &current_mc, const map_cell &next_mc,
+                         bool force_full)
+{
+    uint32_t mask = 0;
+    fields.clear();
+
+    if (current_mc.feat() != next_mc.feat())
+    {
+        mask |= PCF_FEAT;
+        _pack_int(fields, next_mc.feat());
+    }
+
+    map_feature mf = get_cell_map_feature(gc);
+    if (get_cell_map_feature(current_mc) != mf)
+    {
+        mask |= PCF_MAP_FEAT;
+        _pack_int(fields, mf);
+    }
+
+    char32_t glyph = next_sc.glyph;
+    if (current_sc.glyph != glyph)
+    {
+        mask |= PCF_GLYPH;
+        _pack_varint(fields, glyph);
+    }
+    if ((current_sc.colour != next_sc.colour
+         || current_sc.glyph == ' ') && glyph != ' ')
+    {
+        int col = next_sc.colour;
+        col = (_get_brand(col) << 4) | macro_colour(col & 0xF);
+        mask |= PCF_COLOUR;
+        _pack_int(fields, col);
+    }
+
+    const packed_cell &next_pc = next_sc.tile;
+    const packed_cell &current_pc = current_sc.tile;
+
+    if (next_pc.fg != current_pc.fg)
+    {
+        mask |= PCF_FG;
+        _pack_tileidx(fields, next_pc.fg);
+        const tileidx_t fg_idx = next_pc.fg & TILE_FLAG_MASK;
+        if (fg_idx && fg_idx <= TILE_MAIN_MAX)
+        {
+            mask |= PCF_BASE;
+            _pack_int(fields, (int) tileidx_known_base_item(fg_idx));
+        }
+    }
+
+    if (next_pc.bg != current_pc.bg)
+    {
+        mask |= PCF_BG;
+        _pack_tileidx(fields, next_pc.bg);
+    }
+
+    if (next_pc.cloud != current_pc.cloud)
+    {
+        mask |= PCF_CLOUD;
+        _pack_tileidx(fields, next_pc.cloud);
+    }
+
+    // The order of the flags in map_knowledge.js's packed_flags.
+    const bool flags[][2] =
+    {
+        { current_pc.is_bloody, next_pc.is_bloody },
+        { current_pc.old_blood, next_pc.old_blood },
+        { current_pc.is_silenced, next_pc.is_silenced },
+        { current_pc.is_highlighted_summoner,
+          next_pc.is_highlighted_summoner },
+        { current_pc.is_sanctuary, next_pc.is_sanctuary },
+        { current_pc.is_liquefied, next_pc.is_liquefied },
+        { current_pc.quad_glow, next_pc.quad_glow },
+        { (bool) current_pc.disjunct, (bool) next_pc.disjunct },
+        { current_pc.mangrove_water, next_pc.mangrove_water },
+        { current_pc.awakened_forest, next_pc.awakened_forest },
+    };
+    uint32_t changed = 0, values = 0;
+    for (unsigned int i = 0; i < ARRAYSZ(flags); ++i)
+    {
+        if (flags[i][0] != flags[i][1])
+            changed |= 1 << i;
+        if (flags[i][1])
+            values |= 1 << i;
+    }
+    // disjunct is a number, and a change between two true values still
+    // counts as one in the JSON.
+    if (next_pc.disjunct != current_pc.disjunct)
+        changed |= 1 << 7;
+    if (changed)
+    {
+        mask |= PCF_FLAGS;
+        _pack_varint(fields, changed);
+        _pack_varint(fields, values & changed);
+    }
+
+    if (next_pc.halo != current_pc.halo)
+    {
+        mask |= PCF_HALO;
+        _pack_int(fields, next_pc.halo);
+    }
+
+    if (next_pc.orb_glow != current_pc.orb_glow)
+    {
+        mask |= PCF_ORB_GLOW;
+        _pack_int(fields, next_pc.orb_glow);
+    }
+
+    if (next_pc.blood_rotation != current_pc.blood_rotation)
+    {
+        mask |= PCF_BLOOD_ROTATION;
+        _pack_int(fields, next_pc.blood_rotation);
+    }
+
+    if (next_pc.travel_trail != current_pc.travel_trail)
+    {
+        mask |= PCF_TRAVEL_TRAIL;
+        _pack_int(fields, next_pc.travel_trail);
+    }
+
+    if (_needs_flavour(next_pc) &&
+        (next_pc.flv.floor != current_pc.flv.floor
+         || next_pc.flv.special != current_pc.flv.special
+         || !_needs_flavour(current_pc)
+         || force_full))
+    {
+        mask |= PCF_FLAVOUR;
+        _pack_int(fields, next_pc.flv.floor);
+        _pack_int(fields, next_pc.flv.special);
+    }
+
+    bool overlays_changed =
+        next_pc.num_dngn_overlay != current_pc.num_dngn_overlay;
+    for (int i = 0; i < next_pc.num_dngn_overlay && !overlays_changed; i++)
+        if (next_pc.dngn_overlay[i] != current_pc.dngn_overlay[i])
+            overlays_changed = true;
+    if (overlays_changed)
+    {
+        mask |= PCF_OVERLAYS;
+        _pack_varint(fields, next_pc.num_dngn_overlay);
+        for (int i = 0; i < next_pc.num_dngn_overlay; ++i)
+            _pack_int(fields, next_pc.dngn_overlay[i]);
+    }
+
+    if (!mask)
+        return false;
+
+    // The mask goes first, but is only known now. It's short enough not to
+    // need the heap.
+    string packed_mask;
+    _pack_varint(packed_mask, mask);
+    fields.insert(0, packed_mask);
+    return true;
+}
+
 void TilesFramework::_send_cursor(cursor_type type)
 {
     if (m_cursor[type] == NO_CURSOR)
@@ -1571,7 +2123,19 @@ void TilesFramework::_mcache_ref(bool inc)
         }
 }
 
-void TilesFramework::_send_map(bool force_full)
+/**
+ * Send the map cells that changed, or all of them.
+ *
+ * Cells the player's client isn't showing are held back, past the first
+ * MAP_OFFSCREEN_BATCH of them, so that a new level or magic mapping doesn't
+ * go out all at once. They stay dirty, and await_input() sends them a batch
+ * at a time.
+ *
+ * @param force_full whether to send every cell, telling the client to clear
+ *                   its map first.
+ * @param idle whether this is such a batch, rather than a screen update.
+ */
+void TilesFramework::_send_map(bool force_full, bool idle)
 {
     // TODO: prevent in some other / better way?
     if (_send_lock)
@@ -1616,6 +2180,17 @@ void TilesFramework::_send_map(bool force_full)
 
     coord_def last_gc(0, 0);
     bool send_gc = true;
+    cell_packer packed;
+    string packed_fields;
+
+    // Without the minimap, off-screen cells aren't seen until the view
+    // moves, so they can wait for a batch.
+    int offscreen_budget = idle || m_client_minimap ? MAP_OFFSCREEN_BATCH : 0;
+    m_deferred_cells = 0;
+    // A resync clears the map of only the receivers that fell behind. The
+    // others keep what they had, which a later batch, sent to everyone as
+    // changes from an empty cell, would leave stale; so hold nothing back.
+    const bool hold_back = !(force_full && m_resyncing);
 
     json_open_array("cells");
     for (int y = 0; y < GYM; y++)
@@ -1626,6 +2201,21 @@ void TilesFramework::_send_map(bool force_full)
             if (!is_dirty(gc) && !force_full)
                 continue;
 
+            // Monsters always go, so that the client never has one twice.
+            if (hold_back && !_in_client_view(gc)
+                && !env.map_knowledge(gc).monsterinfo()
+                && (force_full
+                    || !m_current_map_knowledge(gc).monsterinfo()))
+            {
+                if (offscreen_budget <= 0)
+                {
+                    mark_dirty(gc);
+                    ++m_deferred_cells;
+                    continue;
+                }
+                --offscreen_budget;
+            }
+
             if (cell_needs_redraw(gc))
             {
                 screen_cell_t *cell = &m_next_view(gc);
@@ -1640,6 +2230,22 @@ void TilesFramework::_send_map(bool force_full)
             if (m_origin.equals(-1, -1))
                 m_origin = gc;
 
+            const screen_cell_t& sc = force_full ? default_cell
+                : m_current_view(gc);
+            const map_cell& mc = force_full ? default_map_cell
+                : m_current_map_knowledge(gc);
+
+            if (m_packed_cells
+                && _can_pack_cell(m_next_view(gc), mc, env.map_knowledge(gc)))
+            {
+                if (_pack_cell(packed_fields, gc, sc, m_next_view(gc), mc,
+                               env.map_knowledge(gc), force_full))
+                {
+                    packed.add(m_origin, gc, packed_fields);
+                }
+                continue;
+            }
+
             json_open_object();
             if (send_gc
                 || last_gc.x + 1 != gc.x
@@ -1650,10 +2256,6 @@ void TilesFramework::_send_map(bool force_full)
                 json_treat_as_empty();
             }
 
-            const screen_cell_t& sc = force_full ? default_cell
-                : m_current_view(gc);
-            const map_cell& mc = force_full ? default_map_cell
-                : m_current_map_knowledge(gc);
             _send_cell(gc,
                        sc,
                        m_next_view(gc),
@@ -1669,6 +2271,9 @@ void TilesFramework::_send_map(bool force_full)
         }
     json_close_array(true);
 
+    if (!packed.empty())
+        json_write_string("packed", packed.base64());
+
     json_close_object(true);
 
     finish_message();
@@ -1679,8 +2284,31 @@ void TilesFramework::_send_map(bool force_full)
     if (m_mcache_ref_done)
         _mcache_ref(false);
 
-    m_current_map_knowledge = env.map_knowledge;
-    m_current_view = m_next_view;
+    if (!m_deferred_cells)
+    {
+        m_current_map_knowledge = env.map_knowledge;
+        m_current_view = m_next_view;
+    }
+    else
+    {
+        // Only the held back cells are still dirty. The client keeps what
+        // it had for them, which is nothing if it just cleared its map.
+        for (int y = 0; y < GYM; y++)
+            for (int x = 0; x < GXM; x++)
+            {
+                const coord_def gc(x, y);
+                if (!is_dirty(gc))
+                {
+                    m_current_map_knowledge(gc) = env.map_knowledge(gc);
+                    m_current_view(gc) = m_next_view(gc);
+                }
+                else if (force_full)
+                {
+                    m_current_map_knowledge(gc) = default_map_cell;
+                    m_current_view(gc) = default_cell;
+                }
+            }
+    }
 
     _mcache_ref(true);
     m_mcache_ref_done = true;
@@ -1913,6 +2541,22 @@ void TilesFramework::_send_everything()
     ui::sync_ui_state();
 }
 
+void TilesFramework::benchmark_send_everything(int iterations, double &ms,
+                                               size_t &bytes)
+{
+    // With no socket, finish_message() counts each message and drops it.
+    unwind_var<string> no_socket(m_sock_name, "");
+    const size_t start_bytes = m_msg_bytes;
+
+    const auto start = chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        _send_everything();
+    const auto end = chrono::steady_clock::now();
+
+    ms = chrono::duration<double, milli>(end - start).count();
+    bytes = m_msg_bytes - start_bytes;
+}
+
 void TilesFramework::clrscr()
 {
     m_text_menu.clear();
@@ -2001,6 +2645,7 @@ void TilesFramework::clear_minimap()
     m_origin = coord_def(-1, -1);
     // Changing the origin invalidates coordinates on the client side
     m_current_gc = coord_def(-1, -1);
+    m_client_view_known = false;
     m_need_full_map = true;
 }
 
@@ -2167,6 +2812,31 @@ void TilesFramework::mark_for_redraw(const coord_def& gc)
     m_cells_needing_redraw[gc.y * GXM + gc.x] = true;
 }
 
+bool TilesFramework::_in_client_view(const coord_def &gc) const
+{
+    // Until the client says otherwise, it shows everything.
+    if (m_client_view_size.x <= 0 || m_client_view_size.y <= 0)
+        return true;
+
+    // The view is centred on the last view centre we sent, unless the
+    // player is looking elsewhere from the minimap.
+    const coord_def half = m_client_view_size / 2;
+    const coord_def from_centre = gc - m_current_gc;
+    if (abs(from_centre.x) <= half.x + CLIENT_VIEW_MARGIN
+        && abs(from_centre.y) <= half.y + CLIENT_VIEW_MARGIN)
+    {
+        return true;
+    }
+
+    if (!m_client_view_known)
+        return false;
+    const coord_def pos = gc - m_origin - m_client_view_tl;
+    return pos.x >= -CLIENT_VIEW_MARGIN
+           && pos.x < m_client_view_size.x + CLIENT_VIEW_MARGIN
+           && pos.y >= -CLIENT_VIEW_MARGIN
+           && pos.y < m_client_view_size.y + CLIENT_VIEW_MARGIN;
+}
+
 void TilesFramework::mark_dirty(const coord_def& gc)
 {
     m_dirty_cells[gc.y * GXM + gc.x] = true;
@@ -2190,36 +2860,69 @@ bool TilesFramework::cell_needs_redraw(const coord_def& gc)
 
 void TilesFramework::write_message_escaped(const string& s)
 {
-    m_msg_buf.reserve(m_msg_buf.size() + s.size());
+    _write_escaped(s.data(), s.size());
+}
+
+// Append s escaped for a JSON string, copying runs that need no escaping in
+// one go.
+void TilesFramework::_write_escaped(const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
 
-    for (unsigned char c : s)
+    size_t run = 0;
+    for (size_t i = 0; i < len; ++i)
     {
+        const unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        m_msg_buf.append(s + run, i - run);
+        run = i + 1;
+
         if (c == '"')
-            m_msg_buf.append("\\\"");
+            m_msg_buf.append("\\\"", 2);
         else if (c == '\\')
-            m_msg_buf.append("\\\\");
-        else if (c < 0x20)
+            m_msg_buf.append("\\\\", 2);
+        else
         {
-            char buf[7];
-            snprintf(buf, sizeof(buf), "\\u%04x", c);
-            m_msg_buf.append(buf);
+            const char esc[] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+            m_msg_buf.append(esc, sizeof(esc));
         }
-        else
-            m_msg_buf.append(1, c);
     }
+    m_msg_buf.append(s + run, len - run);
+}
+
+// A much cheaper %d than the printf family.
+void TilesFramework::_write_int(int value)
+{
+    char buf[12];
+    char *end = buf + sizeof(buf);
+    char *p = end;
+
+    unsigned int n = value < 0 ? 0U - (unsigned int) value : value;
+    do
+    {
+        *--p = '0' + n % 10;
+        n /= 10;
+    }
+    while (n);
+    if (value < 0)
+        *--p = '-';
+
+    m_msg_buf.append(p, end - p);
 }
 
-void TilesFramework::json_open(const string& name, char opener, char type)
+void TilesFramework::json_open(const char *name, char opener, char type)
 {
     m_json_stack.resize(m_json_stack.size() + 1);
     JsonFrame& fr = m_json_stack.back();
     fr.start = m_msg_buf.size();
 
     json_write_comma();
-    if (!name.empty())
+    if (*name)
         json_write_name(name);
 
-    m_msg_buf.append(1, opener);
+    m_msg_buf += opener;
 
     fr.prefix_end = m_msg_buf.size();
     fr.type = type;
@@ -2256,12 +2959,12 @@ void TilesFramework::json_close(bool erase_if_empty, char type)
     if (erase_if_empty && json_is_empty())
         m_msg_buf.resize(m_json_stack.back().start);
     else
-        m_msg_buf.append(1, type);
+        m_msg_buf += type;
 
     m_json_stack.pop_back();
 }
 
-void TilesFramework::json_open_object(const string& name)
+void TilesFramework::json_open_object(const char *name)
 {
     json_open(name, '{', '}');
 }
@@ -2271,7 +2974,7 @@ void TilesFramework::json_close_object(bool erase_if_empty)
     json_close(erase_if_empty, '}');
 }
 
-void TilesFramework::json_open_array(const string& name)
+void TilesFramework::json_open_array(const char *name)
 {
     json_open(name, '[', ']');
 }
@@ -2286,28 +2989,28 @@ void TilesFramework::json_write_comma()
     if (m_msg_buf.empty()) return;
     char last = m_msg_buf[m_msg_buf.size() - 1];
     if (last == '{' || last == '[' || last == ',' || last == ':') return;
-    write_message(",");
+    m_msg_buf += ',';
 }
 
-void TilesFramework::json_write_name(const string& name)
+void TilesFramework::json_write_name(const char *name)
 {
     json_write_comma();
 
-    write_message("\"");
-    write_message_escaped(name);
-    write_message("\":");
+    m_msg_buf += '"';
+    _write_escaped(name, strlen(name));
+    m_msg_buf.append("\":", 2);
 }
 
 void TilesFramework::json_write_int(int value)
 {
     json_write_comma();
 
-    write_message("%d", value);
+    _write_int(value);
 }
 
-void TilesFramework::json_write_int(const string& name, int value)
+void TilesFramework::json_write_int(const char *name, int value)
 {
-    if (!name.empty())
+    if (*name)
         json_write_name(name);
 
     json_write_int(value);
@@ -2318,14 +3021,14 @@ void TilesFramework::json_write_bool(bool value)
     json_write_comma();
 
     if (value)
-        write_message("true");
+        m_msg_buf.append("true", 4);
     else
-        write_message("false");
+        m_msg_buf.append("false", 5);
 }
 
-void TilesFramework::json_write_bool(const string& name, bool value)
+void TilesFramework::json_write_bool(const char *name, bool value)
 {
-    if (!name.empty())
+    if (*name)
         json_write_name(name);
 
     json_write_bool(value);
@@ -2335,12 +3038,12 @@ void TilesFramework::json_write_null()
 {
     json_write_comma();
 
-    write_message("null");
+    m_msg_buf.append("null", 4);
 }
 
-void TilesFramework::json_write_null(const string& name)
+void TilesFramework::json_write_null(const char *name)
 {
-    if (!name.empty())
+    if (*name)
         json_write_name(name);
 
     json_write_null();
@@ -2350,14 +3053,14 @@ void TilesFramework::json_write_string(const string& value)
 {
     json_write_comma();
 
-    write_message("\"");
-    write_message_escaped(value);
-    write_message("\"");
+    m_msg_buf += '"';
+    _write_escaped(value.data(), value.size());
+    m_msg_buf += '"';
 }
 
-void TilesFramework::json_write_string(const string& name, const string& value)
+void TilesFramework::json_write_string(const char *name, const string& value)
 {
-    if (!name.empty())
+    if (*name)
         json_write_name(name);
 
     json_write_string(value);
@@ -8,6 +8,7 @@
 #ifdef USE_TILE_WEB
 
 #include <bitset>
+#include <deque>
 #include <map>
 #include <sys/un.h>
 
@@ -151,7 +152,11 @@ public:
     void send_message(PRINTF(1, ));
     void flush_messages();
 
-    bool has_receivers() { return !m_dest_addrs.empty(); }
+    // Build everything a newly joined spectator is sent, iterations times
+    // over, without sending any of it. For debug.webtiles_benchmark().
+    void benchmark_send_everything(int iterations, double &ms, size_t &bytes);
+
+    bool has_receivers() { return !m_receivers.empty(); }
     bool is_controlled_from_web() { return m_controlled_from_web; }
 
     /* Webtiles can receive input both via stdin, and on the
@@ -165,30 +170,50 @@ public:
        it still has to be read from stdin.
 
        If block is false, await_input will immediately return,
-       even if no input is available. The return value indicates
-       whether input can be read from stdin; c will be non-zero
-       if input came via a control message.
+       even if no input is available. If it is true and timeout_ms
+       isn't negative, it gives up after that many milliseconds,
+       still sending queued output to the receivers meanwhile. The
+       return value indicates whether input can be read from stdin;
+       c will be non-zero if input came via a control message.
      */
-    bool await_input(wint_t& c, bool block);
+    bool await_input(wint_t& c, bool block, int timeout_ms = -1);
 
     void check_for_control_messages();
 
     // Helper functions for writing JSON
+    // These write straight into the message buffer; the const char * name
+    // overloads let literal names through without building a string.
     void write_message_escaped(const string& s);
-    void json_open_object(const string& name = "");
+    void json_open_object(const char *name = "");
+    void json_open_object(const string& name) { json_open_object(name.c_str()); }
     void json_close_object(bool erase_if_empty = false);
-    void json_open_array(const string& name = "");
+    void json_open_array(const char *name = "");
+    void json_open_array(const string& name) { json_open_array(name.c_str()); }
     void json_close_array(bool erase_if_empty = false);
     void json_write_comma();
-    void json_write_name(const string& name);
+    void json_write_name(const char *name);
+    void json_write_name(const string& name) { json_write_name(name.c_str()); }
     void json_write_int(int value);
-    void json_write_int(const string& name, int value);
+    void json_write_int(const char *name, int value);
+    void json_write_int(const string& name, int value)
+    {
+        json_write_int(name.c_str(), value);
+    }
     void json_write_bool(bool value);
-    void json_write_bool(const string& name, bool value);
+    void json_write_bool(const char *name, bool value);
+    void json_write_bool(const string& name, bool value)
+    {
+        json_write_bool(name.c_str(), value);
+    }
     void json_write_null();
-    void json_write_null(const string& name);
+    void json_write_null(const char *name);
+    void json_write_null(const string& name) { json_write_null(name.c_str()); }
     void json_write_string(const string& value);
-    void json_write_string(const string& name, const string& value);
+    void json_write_string(const char *name, const string& value);
+    void json_write_string(const string& name, const string& value)
+    {
+        json_write_string(name.c_str(), value);
+    }
     /* Causes the current object/array to be erased if it is closed
        with erase_if_empty without writing any other content after
        this call */
@@ -218,13 +243,45 @@ protected:
     int m_sock;
     int m_max_msg_size;
     string m_msg_buf;
-    vector<sockaddr_un> m_dest_addrs;
+    size_t m_msg_bytes; // finished so far
+
+    // A webserver process attached to our socket, and the datagrams it
+    // hasn't yet taken. The primary receiver (the player's own) is never
+    // dropped; the others are when they fall behind, and are then sent
+    // everything again once they've caught up.
+    struct Receiver
+    {
+        Receiver(const sockaddr_un &_addr, bool _primary)
+            : addr(_addr), primary(_primary), queued(0), mid_message(false),
+              stalled(false), stalled_since(0), behind(false),
+              behind_since(0)
+        {
+        }
+
+        sockaddr_un addr;
+        bool primary;
+
+        deque<string> fragments; // a message's last one ends with '\n'
+        size_t queued;           // bytes in fragments
+        bool mid_message;        // part of the front message has been sent
+
+        bool stalled;            // the last send would have blocked
+        unsigned int stalled_since;
+        bool behind;             // dropped updates; needs a resync
+        unsigned int behind_since;
+    };
+    vector<Receiver> m_receivers;
+    bool m_resyncing;
 
     bool m_controlled_from_web;
     bool m_need_flush;
 
     bool _send_lock; // not thread safe
 
+    bool _send_queued();
+    void _drop_queued(Receiver &receiver);
+    bool _drain_queued(unsigned int timeout);
+    void _resync_receivers();
     void _await_connection();
     wint_t _handle_control_message(sockaddr_un addr, string data);
     wint_t _receive_control_message();
@@ -237,7 +294,9 @@ protected:
     };
     vector<JsonFrame> m_json_stack;
 
-    void json_open(const string& name, char opener, char type);
+    void json_open(const char *name, char opener, char type);
+    void _write_escaped(const char *s, size_t len);
+    void _write_int(int value);
     void json_close(bool erase_if_empty, char type);
 
     struct UIStackFrame
@@ -284,6 +343,19 @@ protected:
     FixedArray<map_cell, GXM, GYM> m_current_map_knowledge;
     map<uint32_t, coord_def> m_monster_locs;
     bool m_need_full_map;
+    // Whether the client asked for map cells packed rather than as JSON.
+    bool m_packed_cells;
+
+    // What the player's client says it shows: the size of its dungeon view,
+    // where that view is (in client coordinates, so only until the origin
+    // next changes) and whether the minimap is visible. Dirty cells outside
+    // the view are held back and sent in batches; see _send_map().
+    coord_def m_client_view_size;
+    coord_def m_client_view_tl;
+    bool m_client_view_known;
+    bool m_client_minimap;
+    int m_deferred_cells;
+    bool _in_client_view(const coord_def &gc) const;
 
     coord_def m_cursor[CURSOR_MAX];
     coord_def m_last_clicked_grid;
@@ -314,7 +386,7 @@ protected:
     void _mcache_ref(bool inc);
 
     void _send_cursor(cursor_type type);
-    void _send_map(bool force_full = false);
+    void _send_map(bool force_full = false, bool idle = false);
     void _send_cell(const coord_def &gc,
                     const screen_cell_t &current_sc, const screen_cell_t &next_sc,
                     const map_cell &current_mc, const map_cell &next_mc,
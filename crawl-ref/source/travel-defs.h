@@ -9,3 +9,10 @@
 
 typedef int travel_distance_col[GYM];
 typedef travel_distance_col travel_distance_grid_t[GXM];
+
+// Long-distance travel plans a coarse route through square sectors of the
+// map first.
+#define TRAVEL_SECTOR_SIZE 8
+#define TRAVEL_SECTORS_X ((GXM + TRAVEL_SECTOR_SIZE - 1) / TRAVEL_SECTOR_SIZE)
+#define TRAVEL_SECTORS_Y ((GYM + TRAVEL_SECTOR_SIZE - 1) / TRAVEL_SECTOR_SIZE)
+typedef bool travel_corridor[TRAVEL_SECTORS_X][TRAVEL_SECTORS_Y];
@@ -1062,6 +1062,230 @@ static void _fill_exclude_radius(const travel_exclude &exc)
         }
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// travel_sectors
+
+static coord_def _travel_sector(const coord_def &p)
+{
+    return coord_def(p.x / TRAVEL_SECTOR_SIZE, p.y / TRAVEL_SECTOR_SIZE);
+}
+
+// A coarse map of the level for long-distance travel. Each sector is split
+// into pieces: groups of squares that are connected within the sector and
+// that travel could conceivably cross. Pieces in neighbouring sectors are
+// linked if any of their squares touch. This ignores everything that can
+// change from turn to turn (monsters, clouds, exclusions), so a route here
+// is only a guess that the real flood still has to confirm.
+class travel_sectors
+{
+public:
+    explicit travel_sectors(bool try_fallback);
+
+    // Was this built from the terrain the player knows now?
+    bool is_current(bool try_fallback) const;
+
+    // Mark the sectors along the shortest routes from a to b, plus a margin,
+    // and find a lower bound on the length of any path from a to b that
+    // leaves them. Returns false if the coarse map can't connect them.
+    bool find_corridor(const coord_def &a, const coord_def &b,
+                       travel_corridor &sectors, int &detour) const;
+
+private:
+    static dungeon_feature_type known_feat(const coord_def &p);
+    void fill_piece(const coord_def &seed, int id);
+    vector<int> piece_distances(int from) const;
+
+    level_id place;
+    bool fallback;
+    FixedVector<bool, NUM_FEATURES> passable;
+    FixedArray<uint8_t, GXM, GYM> feat;
+    FixedArray<int, GXM, GYM> piece;
+    vector<coord_def> piece_sector;
+    vector<vector<int>> links;
+};
+
+travel_sectors::travel_sectors(bool try_fallback)
+    : place(level_id::current()), fallback(try_fallback), piece(-1)
+{
+    for (int f = 0; f < NUM_FEATURES; f++)
+    {
+        const dungeon_feature_type ft = static_cast<dungeon_feature_type>(f);
+        passable[f] = ft != DNGN_UNSEEN
+                      && (feat_is_traversable_now(ft, try_fallback)
+                          || feat_is_trap(ft));
+    }
+
+    for (rectangle_iterator ri(0); ri; ++ri)
+        feat(*ri) = known_feat(*ri);
+
+    for (rectangle_iterator ri(1); ri; ++ri)
+        if (passable[feat(*ri)])
+            piece(*ri) = 0;
+
+    for (rectangle_iterator ri(1); ri; ++ri)
+        if (piece(*ri) == 0)
+            fill_piece(*ri, piece_sector.size() + 1);
+
+    links.resize(piece_sector.size() + 1);
+    for (rectangle_iterator ri(1); ri; ++ri)
+    {
+        const int id = piece(*ri);
+        if (id <= 0)
+            continue;
+        for (adjacent_iterator ai(*ri); ai; ++ai)
+        {
+            const int other = piece(*ai);
+            if (other > 0 && other != id
+                && find(links[id].begin(), links[id].end(), other)
+                   == links[id].end())
+            {
+                links[id].push_back(other);
+            }
+        }
+    }
+}
+
+dungeon_feature_type travel_sectors::known_feat(const coord_def &p)
+{
+    const map_cell &cell = env.map_knowledge(p);
+    return cell.known() ? cell.feat() : DNGN_UNSEEN;
+}
+
+// Whether a square can be crossed depends on what the player knows is there,
+// and on things like flight and travel_avoid_terrain, so compare both.
+bool travel_sectors::is_current(bool try_fallback) const
+{
+    if (place != level_id::current() || fallback != try_fallback)
+        return false;
+
+    for (int f = 0; f < NUM_FEATURES; f++)
+    {
+        const dungeon_feature_type ft = static_cast<dungeon_feature_type>(f);
+        if (passable[f] != (ft != DNGN_UNSEEN
+                            && (feat_is_traversable_now(ft, try_fallback)
+                                || feat_is_trap(ft))))
+        {
+            return false;
+        }
+    }
+
+    for (rectangle_iterator ri(0); ri; ++ri)
+        if (feat(*ri) != known_feat(*ri))
+            return false;
+
+    return true;
+}
+
+// Flood a piece with the given id (numbered from 1), staying in seed's
+// sector.
+void travel_sectors::fill_piece(const coord_def &seed, int id)
+{
+    const coord_def sector = _travel_sector(seed);
+    piece_sector.push_back(sector);
+
+    vector<coord_def> todo(1, seed);
+    piece(seed) = id;
+    while (!todo.empty())
+    {
+        const coord_def p = todo.back();
+        todo.pop_back();
+        for (adjacent_iterator ai(p); ai; ++ai)
+        {
+            if (in_bounds(*ai) && piece(*ai) == 0
+                && _travel_sector(*ai) == sector)
+            {
+                piece(*ai) = id;
+                todo.push_back(*ai);
+            }
+        }
+    }
+}
+
+// Breadth-first distances, in pieces, from one piece to every other.
+vector<int> travel_sectors::piece_distances(int from) const
+{
+    vector<int> dist(links.size(), INFINITE_DISTANCE);
+    vector<int> todo(1, from);
+    dist[from] = 0;
+    for (unsigned int i = 0; i < todo.size(); i++)
+        for (int next : links[todo[i]])
+            if (dist[next] == INFINITE_DISTANCE)
+            {
+                dist[next] = dist[todo[i]] + 1;
+                todo.push_back(next);
+            }
+    return dist;
+}
+
+bool travel_sectors::find_corridor(const coord_def &a, const coord_def &b,
+                                   travel_corridor &sectors,
+                                   int &detour) const
+{
+    const int from = piece(a), to = piece(b);
+    if (from <= 0 || to <= 0)
+        return false;
+
+    const vector<int> dist_a = piece_distances(from);
+    const int route = dist_a[to];
+    if (route == INFINITE_DISTANCE)
+        return false;
+    const vector<int> dist_b = piece_distances(to);
+
+    memset(sectors, 0, sizeof(travel_corridor));
+    // Allow routes one piece longer than the shortest, since a piece
+    // can be any size.
+    for (unsigned int id = 1; id < links.size(); id++)
+    {
+        if (dist_a[id] == INFINITE_DISTANCE || dist_b[id] == INFINITE_DISTANCE
+            || dist_a[id] + dist_b[id] > route + 1)
+        {
+            continue;
+        }
+
+        // And let the real path stray into the neighbouring sectors.
+        const coord_def s = piece_sector[id - 1];
+        for (int x = max(s.x - 1, 0); x <= min(s.x + 1, TRAVEL_SECTORS_X - 1);
+             x++)
+        {
+            for (int y = max(s.y - 1, 0);
+                 y <= min(s.y + 1, TRAVEL_SECTORS_Y - 1); y++)
+            {
+                sectors[x][y] = true;
+            }
+        }
+    }
+
+    // A path that leaves the corridor has to cross some square outside it.
+    // Getting there takes at least as many moves as the grid distance, and
+    // at least one move per piece boundary crossed.
+    detour = INFINITE_DISTANCE;
+    for (rectangle_iterator ri(1); ri; ++ri)
+    {
+        const int id = piece(*ri);
+        const coord_def s = _travel_sector(*ri);
+        if (id <= 0 || sectors[s.x][s.y]
+            || dist_a[id] == INFINITE_DISTANCE
+            || dist_b[id] == INFINITE_DISTANCE)
+        {
+            continue;
+        }
+
+        detour = min(detour, max(grid_distance(a, *ri), dist_a[id])
+                             + max(grid_distance(*ri, b), dist_b[id]));
+    }
+    return true;
+}
+
+// The coarse map only changes when the player learns about new terrain, so
+// keep it around between travel steps.
+static const travel_sectors &_current_travel_sectors(bool try_fallback)
+{
+    static unique_ptr<travel_sectors> sectors;
+    if (!sectors || !sectors->is_current(try_fallback))
+        sectors.reset(new travel_sectors(try_fallback));
+    return *sectors;
+}
+
 /////////////////////////////////////////////////////////////////////////////
 // travel_pathfind
 
@@ -1079,7 +1303,8 @@ travel_pathfind::travel_pathfind()
       unexplored_place(), greedy_place(), unexplored_dist(0), greedy_dist(0),
       refdist(nullptr), reseed_points(), features(nullptr), unreachables(),
       point_distance(travel_point_distance), points(0), next_iter_points(0),
-      traveled_distance(0), circ_index(0)
+      traveled_distance(0), circ_index(0), try_fallback(false),
+      corridor(nullptr)
 {
 }
 
@@ -1244,6 +1469,28 @@ coord_def travel_pathfind::pathfind(run_mode_type rmode, bool fallback_explore)
     if (!floodout && start == dest)
         return start;
 
+    // On a long trip, first try flooding only the sectors along a coarse
+    // route; most of the level is nowhere near the way there. If that doesn't
+    // get us anywhere, flood everything as usual.
+    if (runmode == RMODE_TRAVEL && !corridor && !features && !annotate_map
+        && grid_distance(start, dest) > 2 * TRAVEL_SECTOR_SIZE
+        && travel_cache.get_level_info(level_id::current())
+                       .get_transporters().empty())
+    {
+        travel_corridor sectors;
+        int detour;
+        if (_current_travel_sectors(try_fallback)
+                .find_corridor(start, dest, sectors, detour))
+        {
+            unwind_var<const travel_corridor*> limit(corridor, &sectors);
+            const coord_def move = pathfind(rmode, fallback_explore);
+            // Only trust the corridor if no way around it could be shorter.
+            if (!move.origin() && traveled_distance <= detour)
+                return move;
+            memset(point_distance, 0, sizeof(travel_distance_grid_t));
+        }
+    }
+
     unwind_bool slime_wall_check(g_Slime_Wall_Check,
                                  !actor_slime_wall_immune(&you));
     unwind_slime_wall_precomputer slime_neighbours(g_Slime_Wall_Check);
@@ -1452,6 +1699,13 @@ bool travel_pathfind::path_flood(const coord_def &c, const coord_def &dc)
     if (!in_bounds(dc) || unreachables.count(dc))
         return false;
 
+    if (corridor)
+    {
+        const coord_def sector = _travel_sector(dc);
+        if (!(*corridor)[sector.x][sector.y])
+            return false;
+    }
+
     if (floodout
         && (runmode == RMODE_EXPLORE || runmode == RMODE_EXPLORE_GREEDY))
     {
@@ -628,6 +628,9 @@ protected:
     // Attempt to path through temporary obstructions (like sealed doors)
     // due to the possibility they are no longer obstructing us
     bool try_fallback;
+
+    // If set, only flood the sectors marked here.
+    const travel_corridor *corridor;
 };
 
 extern TravelCache travel_cache;
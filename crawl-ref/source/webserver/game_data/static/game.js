@@ -165,6 +165,7 @@ function ($, comm, client, dungeon_renderer, display, minimap, enums, messages,
             toggle_full_window_dungeon_view(true);
             break;
         }
+        minimap.report_view();
     }
 
     function handle_set_layout(data)
@@ -223,6 +224,8 @@ function ($, comm, client, dungeon_renderer, display, minimap, enums, messages,
     {
         game_version = data;
         document.title = data.text;
+        if (data.map_formats && data.map_formats.indexOf("packed") != -1)
+            comm.send_message("map_format", {format: "packed"});
     }
 
     var device_ratio = window.devicePixelRatio;
@@ -207,9 +207,139 @@ define(["jquery", "./enums", "./util"], function ($, enums, util) {
         clean_monster_table();
     };
 
+    // Cell fields in a packed map message, as in tileweb.cc's
+    // packed_cell_field, and its boolean tile flags, in order.
+    var PCF_FEAT = 1 << 0, PCF_MAP_FEAT = 1 << 1, PCF_GLYPH = 1 << 2,
+        PCF_COLOUR = 1 << 3, PCF_FG = 1 << 4, PCF_BASE = 1 << 5,
+        PCF_BG = 1 << 6, PCF_CLOUD = 1 << 7, PCF_FLAGS = 1 << 8,
+        PCF_HALO = 1 << 9, PCF_ORB_GLOW = 1 << 10,
+        PCF_BLOOD_ROTATION = 1 << 11, PCF_TRAVEL_TRAIL = 1 << 12,
+        PCF_FLAVOUR = 1 << 13, PCF_OVERLAYS = 1 << 14;
+    var PCF_TILE = ~(PCF_FEAT | PCF_MAP_FEAT | PCF_GLYPH | PCF_COLOUR);
+    var packed_flags = ["bloody", "old_blood", "silenced",
+                        "highlighted_summoner", "sanctuary", "liquefied",
+                        "quad_glow", "disjunct", "mangrove_water",
+                        "awakened_forest"];
+
+    // Unpack the cells of a packed map message (see cell_packer in
+    // tileweb.cc) into the same diffs as the JSON cells, and merge them.
+    function merge_packed(packed)
+    {
+        var data = atob(packed);
+        var pos = 0;
+
+        function uint()
+        {
+            var value = 0, scale = 1, b;
+            do
+            {
+                b = data.charCodeAt(pos++);
+                value += (b & 0x7f) * scale;
+                scale *= 128;
+            }
+            while (b & 0x80);
+            return value;
+        }
+
+        function sint()
+        {
+            var value = uint();
+            return value % 2 ? -(value + 1) / 2 : value / 2;
+        }
+
+        function tileidx()
+        {
+            var lo = uint() | 0;
+            var hi = uint() | 0;
+            return hi ? [lo, hi] : lo;
+        }
+
+        function glyph(c)
+        {
+            if (c < 0x10000)
+                return String.fromCharCode(c);
+            c -= 0x10000;
+            return String.fromCharCode(0xd800 + (c >> 10),
+                                       0xdc00 + (c & 0x3ff));
+        }
+
+        var x0 = sint(), y0 = sint(), width = uint();
+        var index = -1;
+        while (pos < data.length)
+        {
+            index += uint() + 1;
+            var repeats = uint();
+            var mask = uint();
+            var cell = {}, t = {};
+
+            if (mask & PCF_FEAT)
+                cell.f = sint();
+            if (mask & PCF_MAP_FEAT)
+                cell.mf = sint();
+            if (mask & PCF_GLYPH)
+                cell.g = glyph(uint());
+            if (mask & PCF_COLOUR)
+                cell.col = sint();
+            if (mask & PCF_FG)
+            {
+                t.fg = tileidx();
+                t.doll = null;
+                t.mcache = null;
+            }
+            if (mask & PCF_BASE)
+                t.base = sint();
+            if (mask & PCF_BG)
+                t.bg = tileidx();
+            if (mask & PCF_CLOUD)
+                t.cloud = tileidx();
+            if (mask & PCF_FLAGS)
+            {
+                var changed = uint(), values = uint();
+                for (var i = 0; i < packed_flags.length; i++)
+                    if (changed & (1 << i))
+                        t[packed_flags[i]] = !!(values & (1 << i));
+            }
+            if (mask & PCF_HALO)
+                t.halo = sint();
+            if (mask & PCF_ORB_GLOW)
+                t.orb_glow = sint();
+            if (mask & PCF_BLOOD_ROTATION)
+                t.blood_rotation = sint();
+            if (mask & PCF_TRAVEL_TRAIL)
+                t.travel_trail = sint();
+            if (mask & PCF_FLAVOUR)
+            {
+                t.flv = {f: sint()};
+                var special = sint();
+                if (special)
+                    t.flv.s = special;
+            }
+            if (mask & PCF_OVERLAYS)
+            {
+                t.ov = [];
+                for (var n = uint(); n > 0; n--)
+                    t.ov.push(sint());
+            }
+            if (mask & PCF_TILE)
+                cell.t = t;
+
+            for (var r = 0; r <= repeats; r++, index++)
+            {
+                // merge() may keep the diff's objects, so each cell gets
+                // its own copy.
+                var val = $.extend(true, {}, cell);
+                val.x = index % width + x0;
+                val.y = Math.floor(index / width) + y0;
+                merge(val);
+            }
+            index--;
+        }
+    }
+
     return {
         get: get,
         merge: merge_diff,
+        merge_packed: merge_packed,
         clear: clear,
         touch: touch,
         visible: visible,
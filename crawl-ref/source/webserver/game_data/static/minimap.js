@@ -1,7 +1,7 @@
-define(["jquery", "./map_knowledge", "./dungeon_renderer", "./view_data",
-        "./tileinfo-player", "./tileinfo-main", "./tileinfo-dngn", "./enums",
-        "./player", "./options", "./util"],
-function ($, map_knowledge, dungeon_renderer, view_data,
+define(["jquery", "comm", "./map_knowledge", "./dungeon_renderer",
+        "./view_data", "./tileinfo-player", "./tileinfo-main",
+        "./tileinfo-dngn", "./enums", "./player", "./options", "./util"],
+function ($, comm, map_knowledge, dungeon_renderer, view_data,
           tileinfo_player, main, dngn, enums, player, options, util) {
     "use strict";
 
@@ -12,6 +12,7 @@ function ($, map_knowledge, dungeon_renderer, view_data,
     var cell_x = 0, cell_y = 0;
     var display_x = 0, display_y = 0;
     var enabled = true;
+    var reported_view;
 
     function vcolour_to_css_colour(colour)
     {
@@ -30,6 +31,28 @@ function ($, map_knowledge, dungeon_renderer, view_data,
                                display_y + (view.y - cell_y) * cell_h + 0.5,
                                dungeon_renderer.cols * cell_w - 1,
                                dungeon_renderer.rows * cell_h - 1);
+        report_view();
+    }
+
+    function report_view()
+    {
+        // The game sends the cells we show before the rest of the map
+        var view = {
+            x: dungeon_renderer.view.x,
+            y: dungeon_renderer.view.y,
+            cols: dungeon_renderer.cols,
+            rows: dungeon_renderer.rows,
+            minimap: $("#minimap").is(":visible")
+        };
+        if (reported_view && reported_view.x == view.x
+            && reported_view.y == view.y && reported_view.cols == view.cols
+            && reported_view.rows == view.rows
+            && reported_view.minimap == view.minimap)
+        {
+            return;
+        }
+        reported_view = view;
+        comm.send_message("viewport", view);
     }
 
     function fit_to(width)
@@ -227,6 +250,7 @@ function ($, map_knowledge, dungeon_renderer, view_data,
 
     $(document).bind("game_init", function () {
         cell_x = cell_y = display_x = display_y = 0;
+        reported_view = undefined;
 
         $("#minimap_overlay")
             .mousedown(minimap_farview)
@@ -243,5 +267,6 @@ function ($, map_knowledge, dungeon_renderer, view_data,
         update: update,
         do_view_center_update: do_view_center_update,
         stop_minimap_farview: stop_minimap_farview,
+        report_view: report_view,
     }
 });